@@ -0,0 +1,77 @@
+#include "address_index.h"
+
+#include <algorithm>
+
+namespace dynhook {
+
+namespace {
+// Keys searched side by side by the batch find
+const size_t kGroupSize = 8;
+
+// Keys of the slots 8k .. 8k+7 , three levels down , share a cache line
+const size_t kPrefetchStride = 8;
+} // namespace
+
+size_t address_index::fill( const std::vector<uintptr_t>& sorted ,
+    size_t i , size_t k ) {
+  if(k < m_keys.size()) {
+    // In order walk of the implicit tree hands out the sorted addresses
+    i = fill(sorted,i,2*k);
+    m_keys[k] = sorted[i];
+    m_ranks[k] = static_cast<uint32_t>(i);
+    ++i;
+    i = fill(sorted,i,2*k+1);
+  }
+  return i;
+}
+
+void address_index::build( const std::vector<uintptr_t>& sorted ) {
+  m_keys.assign(sorted.size()+1,0);
+  m_ranks.assign(sorted.size()+1,0);
+  fill(sorted,0,1);
+  m_depth = 0;
+  for( size_t n = sorted.size() ; n ; n >>= 1 ) ++m_depth;
+}
+
+size_t address_index::find( uintptr_t key ) const {
+  const size_t n = m_keys.size();
+  if(n <= 1) return npos;
+  // Go right while the slot is <= key , k ends up past a leaf and the
+  // last left turn is the first address > key
+  size_t k = 1;
+  while(k < n) {
+    if(k * kPrefetchStride < n)
+      __builtin_prefetch(&m_keys[k * kPrefetchStride]);
+    k = 2 * k + (m_keys[k] <= key);
+  }
+  return rank_of(k);
+}
+
+void address_index::find( const uintptr_t* keys , size_t count ,
+    size_t* output ) const {
+  const size_t n = m_keys.size();
+  if(n <= 1) {
+    std::fill(output,output+count,npos);
+    return;
+  }
+
+  for( size_t base = 0 ; base < count ; base += kGroupSize ) {
+    const size_t group = std::min(kGroupSize,count - base);
+    size_t k[kGroupSize];
+    std::fill(k,k+group,1);
+
+    // One level of every search at a time , a search that reaches the
+    // bottom early just stays there
+    for( size_t level = 0 ; level < m_depth ; ++level ) {
+      for( size_t i = 0 ; i < group ; ++i ) {
+        if(k[i] >= n) continue;
+        if(k[i] * kPrefetchStride < n)
+          __builtin_prefetch(&m_keys[k[i] * kPrefetchStride]);
+        k[i] = 2 * k[i] + (m_keys[k[i]] <= keys[base+i]);
+      }
+    }
+    for( size_t i = 0 ; i < group ; ++i ) output[base+i] = rank_of(k[i]);
+  }
+}
+
+} // namespace dynhook
@@ -0,0 +1,68 @@
+#ifndef ADDRESS_INDEX_H_
+#define ADDRESS_INDEX_H_
+#include <vector>
+#include <cstddef>
+#include <inttypes.h>
+
+namespace dynhook {
+
+// Search a sorted array of addresses for the last one that is not greater
+// than a key. The addresses are copied into their own array in Eytzinger
+// ( breadth first ) order : the top levels of the implicit tree share a
+// few cache lines , the search is branch free and the cache line of the
+// grand-grand children is prefetched while the current level is compared.
+// This is a lot faster than std::upper_bound over fat symbol_info records
+// once the array doesn't fit into the cache.
+class address_index {
+ public:
+  static const size_t npos = static_cast<size_t>(-1);
+
+  address_index():
+    m_keys(),
+    m_ranks(),
+    m_depth(0)
+  {}
+
+  // The addresses must be sorted , equal addresses are fine
+  void build( const std::vector<uintptr_t>& sorted );
+
+  // Index into the sorted array of the last address <= key , npos if the
+  // key is lower than all of them
+  size_t find( uintptr_t key ) const;
+
+  // Same as find for count keys. The searches are interleaved a group at a
+  // time so the cache misses of different keys overlap.
+  void find( const uintptr_t* keys , size_t count , size_t* output ) const;
+
+  size_t size() const {
+    return m_keys.empty() ? 0 : m_keys.size() - 1;
+  }
+
+  size_t memory_usage() const {
+    return m_keys.capacity() * sizeof(uintptr_t) +
+      m_ranks.capacity() * sizeof(uint32_t);
+  }
+
+ private:
+  size_t fill( const std::vector<uintptr_t>& sorted , size_t i , size_t k );
+
+  // Turn the last slot of a search into the answer
+  size_t rank_of( size_t k ) const {
+    // Cancel the right turns after the last left turn , see find
+    k >>= __builtin_ffsll(~static_cast<unsigned long long>(k));
+    return k ? static_cast<size_t>(m_ranks[k]) - 1 : size() - 1;
+  }
+
+ private:
+  // Slot 0 is not used , the children of slot k are 2k and 2k+1
+  std::vector<uintptr_t> m_keys;
+
+  // Index into the sorted array of each slot
+  std::vector<uint32_t> m_ranks;
+
+  // Levels of the tree
+  size_t m_depth;
+};
+
+} // namespace dynhook
+#endif // ADDRESS_INDEX_H_
@@ -0,0 +1,207 @@
+#include "agent.h"
+#include "stub.h"
+#include "process_info.h"
+#include "remote_allocator.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <cstring>
+#include <ctime>
+#include <cstddef>
+
+#include <glog/logging.h>
+#include <boost/format.hpp>
+#include <boost/scoped_ptr.hpp>
+
+namespace dynhook {
+
+namespace {
+// How long we wait for one command before giving up on the agent , in
+// micro seconds
+const uint64_t kCommandTimeout = 5000000;
+
+// The ring is shared with another process , no FUTEX_PRIVATE_FLAG
+void futex_wake( volatile uint32_t* word ) {
+  ::syscall(SYS_futex,word,FUTEX_WAKE,1,NULL,NULL,0);
+}
+
+void futex_wait( volatile uint32_t* word , uint32_t value ,
+    uint64_t timeout_us ) {
+  struct timespec ts;
+  ts.tv_sec = timeout_us / 1000000;
+  ts.tv_nsec = (timeout_us % 1000000) * 1000;
+  ::syscall(SYS_futex,word,FUTEX_WAIT,value,&ts,NULL,0);
+}
+} // namespace
+
+agent* agent::create( process_info* pinfo , remote_allocator* alloc ) {
+  std::auto_ptr<agent> ret( new agent(pinfo) );
+  if(!ret->init(alloc)) return NULL;
+  return ret.release();
+}
+
+bool agent::init( remote_allocator* alloc ) {
+  // 1. The loop goes into RWX memory , it is flushed by the next invoke
+  boost::scoped_ptr<agent_loop> loop( agent_loop::create(*m_pinfo) );
+  if(!loop) return false;
+  const uintptr_t loop_address = alloc->allocate(loop->size());
+  if(!loop_address ||
+     !m_pinfo->shadow()->write(loop_address,loop->code(),loop->size())) {
+    LOG(ERROR)<<"Cannot write agent loop into remote process!";
+    return false;
+  }
+
+  // 2. Create the ring and the thread , the only ptrace round trip
+  boost::scoped_ptr<start_agent> start( start_agent::create(*m_pinfo,
+        loop_address) );
+  uintptr_t fd;
+  if(!start || !invoke(m_pinfo,*start,0,&fd)) {
+    LOG(ERROR)<<"Cannot invoke start_agent code!";
+    return false;
+  }
+  if(static_cast<intptr_t>(fd) < 0) {
+    LOG(ERROR)<<"Cannot create agent thread in process:"<<m_pinfo->pid()
+      <<"!";
+    return false;
+  }
+
+  // 3. Map the same memfd
+  const std::string path = (boost::format("/proc/%d/fd/%d") %
+      m_pinfo->pid() % fd).str();
+  base::scoped_fd ring_fd( ::open(path.c_str(),O_RDWR|O_CLOEXEC) );
+  if(!ring_fd) {
+    LOG(ERROR)<<"Cannot open agent ring:"<<path<<" with error:"
+      <<std::strerror(errno);
+    return false;
+  }
+  void* addr = ::mmap(NULL,sizeof(agent_ring),PROT_READ|PROT_WRITE,
+      MAP_SHARED,ring_fd.fd(),0);
+  if(addr == MAP_FAILED) {
+    LOG(ERROR)<<"Cannot mmap agent ring:"<<path<<" with error:"
+      <<std::strerror(errno);
+    return false;
+  }
+  m_ring = static_cast<agent_ring*>(addr);
+  m_remote = m_ring->self;
+
+  // 4. Everything from now on goes through the ring , starting with
+  // closing the fd in the process
+  const process_info::symbol_info* close =
+    m_pinfo->find_dynamic_symbol("close");
+  const process_info::symbol_info* dlopen =
+    m_pinfo->find_dynamic_symbol("__libc_dlopen_mode");
+  const process_info::symbol_info* dlsym =
+    m_pinfo->find_dynamic_symbol("__libc_dlsym");
+  if(dlopen) m_dlopen = dlopen->base;
+  if(dlsym) m_dlsym = dlsym->base;
+
+  uintptr_t args[1] = { static_cast<uintptr_t>(m_ring->fd) };
+  uintptr_t result;
+  if(!close || !call(close->base,args,1,&result)) {
+    LOG(ERROR)<<"Agent in process:"<<m_pinfo->pid()<<" doesn't respond!";
+    return false;
+  }
+  LOG(INFO)<<"Agent ring of process:"<<m_pinfo->pid()<<" is at:"
+    <<std::hex<<m_remote<<std::dec<<"!";
+  return true;
+}
+
+agent::~agent() {
+  if(!m_ring) return;
+  agent_command command;
+  memset(&command,0,sizeof(command));
+  command.op = agent_command::EXIT;
+  uint32_t sequence;
+  if(submit(command,&sequence)) wait(sequence);
+  ::munmap(m_ring,sizeof(agent_ring));
+}
+
+agent_command agent::make_call( uintptr_t function ,
+    const uintptr_t* args , size_t count ) {
+  agent_command command;
+  memset(&command,0,sizeof(command));
+  command.op = agent_command::CALL;
+  command.function = function;
+  for( size_t i = 0 ; i < count && i < 6 ; ++i )
+    command.args[i] = args[i];
+  return command;
+}
+
+bool agent::submit( const agent_command& command , uint32_t* sequence ) {
+  const uint32_t head = m_ring->head;
+  // Wait for the agent to free a slot
+  if(head - m_ring->tail >= agent_ring::kSlots &&
+     !wait(head - agent_ring::kSlots))
+    return false;
+  m_ring->slots[head & (agent_ring::kSlots-1)] = command;
+  __sync_synchronize();
+  m_ring->head = head + 1;
+  futex_wake(&m_ring->head);
+  *sequence = head;
+  return true;
+}
+
+bool agent::wait( uint32_t sequence ) {
+  const uint64_t start = base::monotonic_us();
+  for( ;; ) {
+    const uint32_t tail = m_ring->tail;
+    if(static_cast<int32_t>(tail - sequence) > 0) break;
+    const uint64_t now = base::monotonic_us();
+    if(now - start > kCommandTimeout) {
+      LOG(ERROR)<<"Agent doesn't finish command:"<<sequence<<" in "
+        <<kCommandTimeout<<" us!";
+      return false;
+    }
+    futex_wait(&m_ring->tail,tail,kCommandTimeout - (now - start));
+  }
+  __sync_synchronize();
+  return true;
+}
+
+bool agent::run( const agent_command& command , uintptr_t* result ) {
+  uint32_t sequence;
+  if(!submit(command,&sequence) || !wait(sequence)) return false;
+  *result = m_ring->slots[sequence & (agent_ring::kSlots-1)].result;
+  return true;
+}
+
+bool agent::call( uintptr_t function , const uintptr_t* args , size_t count ,
+    uintptr_t* result ) {
+  return run(make_call(function,args,count),result);
+}
+
+bool agent::post_call( uintptr_t function , const uintptr_t* args ,
+    size_t count , uint32_t* sequence ) {
+  return submit(make_call(function,args,count),sequence);
+}
+
+uintptr_t agent::put_string( size_t offset , const std::string& str ) {
+  if(offset + str.size() + 1 > agent_ring::kDataSize) return 0;
+  memcpy(m_ring->data + offset,str.c_str(),str.size() + 1);
+  return m_remote + offsetof(agent_ring,data) + offset;
+}
+
+bool agent::load_symbol( const std::string& so , const std::string& name ,
+    uintptr_t* address ) {
+  if(!m_dlopen || !m_dlsym) return false;
+  // Commands run one at a time here , so the data area is ours
+  const uintptr_t so_address = put_string(0,so);
+  const uintptr_t name_address = put_string(so.size() + 1,name);
+  if(!so_address || !name_address) return false;
+
+  uintptr_t handle;
+  const uintptr_t open_args[2] = { so_address , 2 };
+  if(!call(m_dlopen,open_args,2,&handle)) return false;
+  if(!handle) {
+    *address = 0;
+    return true;
+  }
+  const uintptr_t sym_args[2] = { handle , name_address };
+  return call(m_dlsym,sym_args,2,address);
+}
+
+} // namespace dynhook
@@ -0,0 +1,126 @@
+#ifndef AGENT_H_
+#define AGENT_H_
+#include "base.h"
+
+#include <string>
+#include <cstddef>
+#include <inttypes.h>
+#include <boost/noncopyable.hpp>
+
+namespace dynhook {
+class process_info;
+class remote_allocator;
+
+// Shared memory between dynhook and the agent thread , see agent. The
+// tracer produces commands at head and the agent consumes them at tail ,
+// each side only writes its own index. Both indexes are futex words.
+struct agent_command {
+  enum {
+    CALL = 1, // result = function(args[0],...,args[5])
+    EXIT = 2  // Unmap the ring and end the agent thread
+  };
+
+  uint64_t op;
+  uint64_t function;
+  uint64_t args[6];
+  uint64_t result;
+  uint64_t reserved;
+};
+
+struct agent_ring {
+  static const size_t kSlots = 64;      // Power of 2
+  static const size_t kDataSize = 8192; // Strings passed to the commands
+
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  int32_t fd;      // The memfd in the process , closed by the first command
+  uint32_t reserved;
+  uint64_t self;   // Address of the ring in the process
+  uint64_t thread; // pthread_t of the agent thread
+  agent_command slots[kSlots];
+  char data[kDataSize];
+};
+
+// A thread living in the target process that runs commands for us , so
+// the operations after it is injected don't need ptrace at all : no stop ,
+// no register swap and no int3 round trip. dynhook loads the Hook and
+// Entry functions and calls the Entry functions through it.
+//
+// The agent is injected once with one invoke ( see start_agent ) : it
+// creates a memfd , maps it shared , and starts a thread running the loop
+// generated by agent_loop. We map the same memfd through /proc/pid/fd ,
+// which works even if the target cannot open anything of ours. The agent
+// sleeps on the head futex until a command shows up , runs it , publishes
+// the tail and wakes us up.
+//
+// The agent thread is detached from ptrace , so it keeps running while
+// the rest of the process is stopped by us.
+class agent : private boost::noncopyable {
+ public:
+  // All the threads of the process must be stopped , NULL on failure
+  static agent* create( process_info* pinfo , remote_allocator* alloc );
+
+  // Tell the agent thread to exit
+  ~agent();
+
+  // Call a function of the process with up to 6 integer arguments
+  bool call( uintptr_t function , const uintptr_t* args , size_t count ,
+      uintptr_t* result );
+
+  // dlopen the so object and dlsym the symbol , 0 if either fails
+  bool load_symbol( const std::string& so , const std::string& name ,
+      uintptr_t* address );
+
+  // Queue a call without waiting for it , the result is dropped. Calls
+  // queued back to back run in order while we keep queueing.
+  bool post_call( uintptr_t function , const uintptr_t* args , size_t count ,
+      uint32_t* sequence );
+
+  // Wait until the command of the sequence and all before it are run
+  bool wait( uint32_t sequence );
+
+  // Number of commands the agent has finished so far
+  size_t command_count() const {
+    return m_ring->tail;
+  }
+
+  // Address of the ring in the process
+  uintptr_t remote_ring() const {
+    return m_remote;
+  }
+
+ private:
+  explicit agent( process_info* pinfo ):
+    m_pinfo(pinfo),
+    m_ring(NULL),
+    m_remote(0),
+    m_dlopen(0),
+    m_dlsym(0)
+  {}
+
+  static agent_command make_call( uintptr_t function ,
+      const uintptr_t* args , size_t count );
+
+  bool init( remote_allocator* alloc );
+
+  // Queue a command , wait for a free slot if the ring is full
+  bool submit( const agent_command& command , uint32_t* sequence );
+
+  // submit and wait
+  bool run( const agent_command& command , uintptr_t* result );
+
+  // Copy a string into the data area , the address in the process
+  uintptr_t put_string( size_t offset , const std::string& str );
+
+ private:
+  process_info* m_pinfo;
+  agent_ring* m_ring;
+  uintptr_t m_remote;
+
+  // Functions used by the commands
+  uintptr_t m_dlopen;
+  uintptr_t m_dlsym;
+};
+
+} // namespace dynhook
+#endif // AGENT_H_
@@ -2,6 +2,7 @@
 #include <libelf.h>
 #include <glog/logging.h>
 #include <udis86.h>
+#include <time.h>
 
 namespace dynhook {
 
@@ -12,6 +13,13 @@ bool init_the_world( int argc , char* argv[] ) {
 }
 
 namespace base {
+uint64_t monotonic_us() {
+  struct timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC,&ts);
+  return static_cast<uint64_t>(ts.tv_sec)*1000000 +
+    static_cast<uint64_t>(ts.tv_nsec)/1000;
+}
+
 void dump_assembly( const char* cd , size_t sz ,
     std::ostream& output ) {
   ud_t ud_obj;
@@ -5,6 +5,9 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <cstring>
+#include <string>
+#include <iostream>
+#include <algorithm>
 #include <boost/array.hpp>
 
 #define UNUSED_ARG(X) (void)(X)
@@ -73,6 +76,77 @@ class int64_array {
   boost::array<char,sizeof(uintptr_t)> m_arr;
 };
 
+// A non owning view of a string , for example a name inside of a mapped
+// string table. Whoever owns the bytes must outlive the view.
+class string_ref {
+ public:
+  string_ref():
+    m_ptr(""),
+    m_len(0)
+  {}
+
+  string_ref( const char* str ):
+    m_ptr(str),
+    m_len(strlen(str))
+  {}
+
+  string_ref( const char* str , size_t len ):
+    m_ptr(str),
+    m_len(len)
+  {}
+
+  string_ref( const std::string& str ):
+    m_ptr(str.c_str()),
+    m_len(str.size())
+  {}
+
+  const char* data() const {
+    return m_ptr;
+  }
+
+  size_t size() const {
+    return m_len;
+  }
+
+  bool empty() const {
+    return m_len == 0;
+  }
+
+  std::string str() const {
+    return std::string(m_ptr,m_len);
+  }
+
+  int compare( const string_ref& other ) const {
+    int ret = memcmp(m_ptr,other.m_ptr,std::min(m_len,other.m_len));
+    if(ret) return ret;
+    return m_len < other.m_len ? -1 : (m_len > other.m_len ? 1 : 0);
+  }
+
+  bool operator == ( const string_ref& other ) const {
+    return m_len == other.m_len && memcmp(m_ptr,other.m_ptr,m_len) == 0;
+  }
+
+  bool operator != ( const string_ref& other ) const {
+    return !(*this == other);
+  }
+
+  bool operator < ( const string_ref& other ) const {
+    return compare(other) < 0;
+  }
+
+ private:
+  const char* m_ptr;
+  size_t m_len;
+};
+
+inline std::ostream& operator << ( std::ostream& output ,
+    const string_ref& str ) {
+  return output.write(str.data(),str.size());
+}
+
+// Monotonic clock in micro seconds , used for measuring pause windows
+uint64_t monotonic_us();
+
 template< typename T , typename U >
 inline T alignment( T value , U target ) {
   return (value + target-1) &~(target-1);
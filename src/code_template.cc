@@ -0,0 +1,132 @@
+#include "code_template.h"
+
+namespace dynhook {
+namespace templates {
+
+namespace {
+const unsigned char kAbsoluteJumpCode[] = {
+  0x68,0x00,0x00,0x00,0x00,                     // push low32
+  0xc7,0x44,0x24,0x04,0x00,0x00,0x00,0x00,      // mov dword [rsp+4],high32
+  0xc3                                          // ret
+};
+
+const unsigned char kRelativeJumpCode[] = {
+  0xe9,0x00,0x00,0x00,0x00                      // jmp rel32
+};
+
+const unsigned char kMemMapCode[] = {
+  0x90,                                         // nop
+  0x90,                                         // nop
+  0x48,0xbf,0,0,0,0,0,0,0,0,                    // mov rdi,address
+  0x48,0xbe,0,0,0,0,0,0,0,0,                    // mov rsi,size
+  0xba,0x07,0x00,0x00,0x00,                     // mov edx,7
+  0x48,0xb9,0,0,0,0,0,0,0,0,                    // mov rcx,flag
+  0x49,0xc7,0xc0,0xff,0xff,0xff,0xff,           // mov r8,-1
+  0x45,0x31,0xc9,                               // xor r9d,r9d
+  0x48,0xb8,0,0,0,0,0,0,0,0,                    // mov rax,mmap
+  0xff,0xd0,                                    // call rax
+  0xcc                                          // int 3
+};
+
+const unsigned char kMemUnmapCode[] = {
+  0x90,                                         // nop
+  0x90,                                         // nop
+  0x48,0xbf,0,0,0,0,0,0,0,0,                    // mov rdi,address
+  0x48,0xbe,0,0,0,0,0,0,0,0,                    // mov rsi,size
+  0x48,0xb8,0,0,0,0,0,0,0,0,                    // mov rax,munmap
+  0xff,0xd0,                                    // call rax
+  0xcc                                          // int 3
+};
+
+const unsigned char kCallResolverCode[] = {
+  0x90,                                         // nop
+  0x90,                                         // nop
+  0x48,0x81,0xec,0x80,0x00,0x00,0x00,           // sub rsp,128
+  0x48,0x83,0xe4,0xf0,                          // and rsp,-16
+  0x48,0xb8,0,0,0,0,0,0,0,0,                    // mov rax,resolver
+  0xff,0xd0,                                    // call rax
+  0xcc                                          // int 3
+};
+
+const unsigned char kLoadSymbolCode[] = {
+  0x90,                                         // nop
+  0x90,                                         // nop
+  0x48,0x8d,0x3d,0x00,0x00,0x00,0x00,           // lea rdi,[rip+so]
+  0xbe,0x02,0x00,0x00,0x00,                     // mov esi,2
+  0x48,0xb8,0,0,0,0,0,0,0,0,                    // mov rax,dlopen
+  0xff,0xd0,                                    // call rax
+  0x48,0x85,0xc0,                               // test rax,rax
+  0x75,0x06,                                    // jnz >1
+  0xb8,0x01,0x00,0x00,0x00,                     // mov eax,1
+  0xcc,                                         // int 3
+  0x48,0x89,0xc7,                               // 1: mov rdi,rax
+  0x48,0x8d,0x35,0x00,0x00,0x00,0x00,           // lea rsi,[rip+name]
+  0x48,0xb8,0,0,0,0,0,0,0,0,                    // mov rax,dlsym
+  0xff,0xd0,                                    // call rax
+  0xcc                                          // int 3
+};
+
+const unsigned char kSetPatchedFuncCode[] = {
+  0x90,                                         // nop
+  0x90,                                         // nop
+  0x48,0x8d,0x3d,0x00,0x00,0x00,0x00,           // lea rdi,[rip+so]
+  0xbe,0x02,0x00,0x00,0x00,                     // mov esi,2
+  0x41,0x51,                                    // push r9
+  0x41,0x50,                                    // push r8
+  0x48,0xb8,0,0,0,0,0,0,0,0,                    // mov rax,dlopen
+  0xff,0xd0,                                    // call rax
+  0x41,0x58,                                    // pop r8
+  0x41,0x59,                                    // pop r9
+  0x48,0x85,0xc0,                               // test rax,rax
+  0x75,0x01,                                    // jnz >1
+  0xcc,                                         // int 3
+  0x48,0x89,0xc7,                               // 1: mov rdi,rax
+  0x48,0x8d,0x35,0x00,0x00,0x00,0x00,           // lea rsi,[rip+name]
+  0x41,0x50,                                    // push r8
+  0x41,0x51,                                    // push r9
+  0x48,0xb8,0,0,0,0,0,0,0,0,                    // mov rax,dlsym
+  0xff,0xd0,                                    // call rax
+  0x41,0x59,                                    // pop r9
+  0x41,0x58,                                    // pop r8
+  0x48,0x85,0xc0,                               // test rax,rax
+  0x75,0x06,                                    // jnz >2
+  0xb8,0x02,0x00,0x00,0x00,                     // mov eax,2
+  0xcc,                                         // int 3
+  0x4c,0x89,0xcf,                               // 2: mov rdi,r9
+  0x48,0xbe,0,0,0,0,0,0,0,0,                    // mov rsi,target
+  0xff,0xd0,                                    // call rax
+  0x31,0xc0,                                    // xor eax,eax
+  0xcc                                          // int 3
+};
+} // namespace
+
+const code_template kAbsoluteJump = {
+  kAbsoluteJumpCode , sizeof(kAbsoluteJumpCode)
+};
+
+const code_template kRelativeJump = {
+  kRelativeJumpCode , sizeof(kRelativeJumpCode)
+};
+
+const code_template kMemMap = {
+  kMemMapCode , sizeof(kMemMapCode)
+};
+
+const code_template kMemUnmap = {
+  kMemUnmapCode , sizeof(kMemUnmapCode)
+};
+
+const code_template kCallResolver = {
+  kCallResolverCode , sizeof(kCallResolverCode)
+};
+
+const code_template kLoadSymbol = {
+  kLoadSymbolCode , sizeof(kLoadSymbolCode)
+};
+
+const code_template kSetPatchedFunc = {
+  kSetPatchedFuncCode , sizeof(kSetPatchedFuncCode)
+};
+
+} // namespace templates
+} // namespace dynhook
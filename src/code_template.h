@@ -0,0 +1,104 @@
+#ifndef CODE_TEMPLATE_H_
+#define CODE_TEMPLATE_H_
+#include <cstddef>
+#include <cstring>
+#include <inttypes.h>
+
+namespace dynhook {
+
+// Machine code of the stubs and jumps whose shape never changes , assembled
+// ahead of time. Every field that differs between two instances ( an
+// address , a size , where a string is ) is zero in the template and its
+// offset is listed next to it. Building one is a memcpy and a few stores
+// instead of a whole DynASM setup , link and encode ; the patches need a
+// few of them per hook , and the stubs with a variable shape ( the batch
+// stubs ) stay in stub.dasc.
+struct code_template {
+  const unsigned char* code;
+  size_t size;
+};
+
+// Copy the template to the buffer , which must hold size bytes
+inline void emit_template( const code_template& t , char* buffer ) {
+  memcpy(buffer,t.code,t.size);
+}
+
+// Store an immediate at the offset , x86 is little endian like us
+template< typename T >
+inline void patch_field( char* buffer , size_t offset , T value ) {
+  memcpy(buffer + offset,&value,sizeof(value));
+}
+
+// Displacement of a rip relative operand whose instruction ends at end ,
+// both are offsets in the same buffer
+inline int32_t rip_displacement( size_t end , size_t target ) {
+  return static_cast<int32_t>(static_cast<intptr_t>(target) -
+      static_cast<intptr_t>(end));
+}
+
+namespace templates {
+
+// push low32 ; mov dword [rsp+4],high32 ; ret
+extern const code_template kAbsoluteJump;
+enum {
+  kAbsoluteJumpLow = 1,  // int32_t
+  kAbsoluteJumpHigh = 9  // int32_t
+};
+
+// jmp rel32
+extern const code_template kRelativeJump;
+enum {
+  kRelativeJumpOffset = 1 // int32_t , relative to the end of the jump
+};
+
+// mmap(address,size,PROT_READ|PROT_WRITE|PROT_EXEC,flag,-1,0) , see mem_map
+extern const code_template kMemMap;
+enum {
+  kMemMapAddress = 4,   // uint64_t
+  kMemMapSize = 14,     // uint64_t
+  kMemMapFlag = 29,     // uint64_t
+  kMemMapFunction = 49  // uint64_t , mmap
+};
+
+// munmap(address,size) , see mem_unmap
+extern const code_template kMemUnmap;
+enum {
+  kMemUnmapAddress = 4,  // uint64_t
+  kMemUnmapSize = 14,    // uint64_t
+  kMemUnmapFunction = 24 // uint64_t , munmap
+};
+
+// Align the stack and call a function without arguments , see
+// call_resolver
+extern const code_template kCallResolver;
+enum {
+  kCallResolverFunction = 15 // uint64_t
+};
+
+// dlsym(dlopen(so,2),name) , the strings are in front of the code , see
+// load_symbol
+extern const code_template kLoadSymbol;
+enum {
+  kLoadSymbolSo = 5,       // int32_t , rip relative
+  kLoadSymbolSoEnd = 9,
+  kLoadSymbolDlopen = 16,  // uint64_t
+  kLoadSymbolName = 43,    // int32_t , rip relative
+  kLoadSymbolNameEnd = 47,
+  kLoadSymbolDlsym = 49    // uint64_t
+};
+
+// dlsym(dlopen(so,2),name)(r9,target) , see set_patched_func
+extern const code_template kSetPatchedFunc;
+enum {
+  kSetPatchedFuncSo = 5,       // int32_t , rip relative
+  kSetPatchedFuncSoEnd = 9,
+  kSetPatchedFuncDlopen = 20,  // uint64_t
+  kSetPatchedFuncName = 46,    // int32_t , rip relative
+  kSetPatchedFuncNameEnd = 50,
+  kSetPatchedFuncDlsym = 56,   // uint64_t
+  kSetPatchedFuncTarget = 86   // uint64_t
+};
+
+} // namespace templates
+} // namespace dynhook
+#endif // CODE_TEMPLATE_H_
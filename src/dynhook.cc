@@ -1,9 +1,14 @@
 #include "dynhook.h"
 #include "base.h"
+#include "agent.h"
 #include "patch.h"
+#include "live_patch.h"
+#include "pause_planner.h"
 #include "process_info.h"
+#include "name_index.h"
 #include "stub.h"
 #include "remote_allocator.h"
+#include "remote_memory.h"
 #include "ptrace_util.h"
 
 #include <cstdio>
@@ -33,6 +38,30 @@ bool parse_command( int argc , char* argv[] , po::variables_map* vm ) {
      po::value< std::vector<std::string> >()->composing(),
      "Specify the hook!")
     ("debug","Show verbose debug output!")
+    ("live","Install hooks without stopping the process!")
+    ("agent","Inject a resident agent thread and send the calls after "
+     "the hooks are loaded through its shared memory ring!")
+    ("memory-backend",
+     po::value<std::string>()->default_value("procmem"),
+     "Specify how to access remote memory: ptrace, vm or procmem!")
+    ("symbol-loader",
+     po::value<std::string>()->default_value("mmap"),
+     "Specify how to load symbol tables: mmap or libelf!")
+    ("symbol-cache",
+     po::value<std::string>(),
+     "Specify a directory to cache symbol tables and function analysis!")
+    ("symbol-threads",
+     po::value<size_t>(),
+     "Specify how many threads load the symbol tables , default is the "
+     "number of online CPUs!")
+    ("invoke-thread",
+     po::value<pid_t>(),
+     "Specify the thread that runs the injected code , default is an idle "
+     "thread!")
+    ("pause-budget",
+     po::value<uint64_t>()->default_value(0),
+     "Keep the process running while preparing and install hooks in stop "
+     "windows of at most this many micro seconds , 0 means stop once!")
     ;
 
   po::store(po::parse_command_line(argc,argv,desc),*vm);
@@ -61,13 +90,13 @@ struct hook {
 };
 
 // Hook string: path@target_function:hooked_function:entry_function
+// The target may be a pattern with "::" in it , so the hook and the entry
+// function are taken from the end.
 bool parse_hook( const std::string& str , hook* h ) {
-  std::string::size_type start,end;
-  start = 0;
-  end = 0;
+  std::string::size_type start,end,entry;
 
-  if((end = str.find("@",start)) != std::string::npos ) {
-    h->path = str.substr(start,end-start);
+  if((end = str.find("@")) != std::string::npos ) {
+    h->path = str.substr(0,end);
   } else {
     std::cerr<<"The hook argument is wrong, haven't found \"@\" for "
       "path of the so object!";
@@ -75,25 +104,21 @@ bool parse_hook( const std::string& str , hook* h ) {
   }
 
   start = end + 1;
-  if ((end = str.find(":",start)) != std::string::npos ) {
-    h->target = str.substr(start,end-start);
-  } else {
+  if((entry = str.rfind(":")) == std::string::npos || entry < start) {
     std::cerr<<"The hook argument is wrong, haven't found \":\" for "
-      "target function!";
+      "hook function!";
     return false;
   }
-
-  start = end + 1;
-  if((end = str.find(":",start)) != std::string::npos) {
-    h->hook = str.substr(start,end-start);
-  } else {
+  if ((end = str.rfind(":",entry-1)) == std::string::npos || end < start ||
+      entry == 0) {
     std::cerr<<"The hook argument is wrong, haven't found \":\" for "
-      "hook function!";
+      "target function!";
     return false;
   }
 
-  start = end + 1;
-  h->entry = str.substr(start,str.size()-start);
+  h->target = str.substr(start,end-start);
+  h->hook = str.substr(end+1,entry-end-1);
+  h->entry = str.substr(entry+1);
 
   LOG(INFO)<<"Hook option:"<<h->path<<"@"
     <<h->target<<":"<<h->hook<<":"<<h->entry;
@@ -106,12 +131,20 @@ bool main( int argc , char* argv[] ) {
   pid_t pid;
   patch_manager mgr;
   bool debug = false;
+  bool live = false;
+  bool use_agent = false;
   if(!parse_command(argc,argv,&config))
     return false;
 
   if(config.count("debug"))
     debug = true;
 
+  if(config.count("live"))
+    live = true;
+
+  if(config.count("agent"))
+    use_agent = true;
+
   // Get the pid
   try {
     pid = config["pid"].as<pid_t>();
@@ -129,6 +162,22 @@ bool main( int argc , char* argv[] ) {
     return false;
   }
 
+  // Get the remote memory backend
+  int memory_backend = remote_memory::parse_backend(
+      config["memory-backend"].as<std::string>());
+  if(memory_backend < 0) {
+    std::cerr<<"memory-backend value invalid!";
+    return false;
+  }
+
+  // Get the symbol loader
+  int symbol_loader = process_info::parse_symbol_loader(
+      config["symbol-loader"].as<std::string>());
+  if(symbol_loader < 0) {
+    std::cerr<<"symbol-loader value invalid!";
+    return false;
+  }
+
   BOOST_FOREACH(std::string& str, hooks) {
     hook hk;
     if(!parse_hook(str,&hk))
@@ -136,16 +185,34 @@ bool main( int argc , char* argv[] ) {
     hook_name_list.push_back(hk);
   }
 
+  // A pause budget only makes sense when the process is stopped for patching
+  const uint64_t pause_budget = config["pause-budget"].as<uint64_t>();
+  const bool planned = !live && pause_budget > 0;
+
   // Now start to do our patching job here
   {
     boost::scoped_ptr<process_info> pinfo(
-        process_info::create(pid));
+        process_info::create(pid,memory_backend,symbol_loader));
     if(!pinfo) {
       std::cerr<<"Cannot create process_info objects, see log for detail!";
       return false;
     }
 
-    if(debug) pinfo->dump(std::cout);
+    if(config.count("symbol-cache"))
+      pinfo->set_symbol_cache(config["symbol-cache"].as<std::string>());
+
+    const long cpus = ::sysconf(_SC_NPROCESSORS_ONLN);
+    pinfo->set_symbol_threads(config.count("symbol-threads") ?
+        config["symbol-threads"].as<size_t>() :
+        static_cast<size_t>(cpus > 0 ? cpus : 1));
+
+    if(config.count("invoke-thread"))
+      pinfo->set_invoke_thread(config["invoke-thread"].as<pid_t>());
+
+    if(debug) {
+      pinfo->load_all_symbols();
+      pinfo->dump(std::cout);
+    }
 
     // Now attach all the process
     if(!pinfo->attach_all()) {
@@ -153,101 +220,262 @@ bool main( int argc , char* argv[] ) {
       return false;
     }
 
-    // Now create remote allocator
+    if(debug) {
+      std::cout<<"Stop the world takes:"<<pinfo->stop_duration()<<" us\n";
+    }
+
+    // Now create remote allocator. Its first invoke maps the scratch area
+    // of invoke , which borrows the text of the entry module for a moment ,
+    // so it runs while every thread is still stopped.
     remote_allocator alloc(pinfo.get());
     if(!alloc.init()) {
       std::cerr<<"Cannot initialize remote allocator, see log for detail!";
       return false;
     }
 
-    // Now create all the patches
-    boost::ptr_vector<patch> patch_list;
+    // Let the process run while we prepare the patches
+    pause_planner planner(pinfo.get(),pause_budget);
+    if(planned && !planner.begin()) {
+      std::cerr<<"Cannot resume the process, see log for detail!";
+      return false;
+    }
 
-    BOOST_FOREACH(const hook& hk , hook_name_list) {
-      boost::scoped_ptr<stub> ls_stub(load_symbol::create(
-          *pinfo,hk.path,hk.hook));
-      if(!ls_stub){
-        std::cerr<<"Cannot create stub code , see log for detail!";
-        return false;
-      }
-      uintptr_t new_function;
-      if(!invoke(pinfo.get(),*ls_stub,0,&new_function)) {
-        std::cerr<<"Cannot load new function in remote process, see log for "
-          "detail!";
+    // The agent is injected with one invoke , after that its commands
+    // don't stop the process at all
+    boost::scoped_ptr<agent> resident;
+    if(use_agent) {
+      resident.reset(agent::create(pinfo.get(),&alloc));
+      if(!resident) {
+        std::cerr<<"Cannot inject the agent, see log for detail!";
         return false;
       }
-      if(new_function == 0) {
-        std::cerr<<"Cannot load function:"<<hk.hook<<", see log for detail!";
-        return false;
+    }
+
+    // Now create all the patches , a pattern target creates one patch per
+    // matched function
+    boost::ptr_vector<patch> patch_list;
+    std::vector<size_t> patch_hooks;
+
+    // Load the Hook and the Entry of every hook in one invoke , each shared
+    // object is opened once. The agent loads them without an invoke.
+    std::vector<symbol_request> requests;
+    BOOST_FOREACH(const hook& hk , hook_name_list) {
+      requests.push_back(symbol_request(hk.path,hk.hook));
+      requests.push_back(symbol_request(hk.path,hk.entry));
+    }
+    std::vector<uintptr_t> functions;
+    if(resident) {
+      BOOST_FOREACH(const symbol_request& request, requests) {
+        uintptr_t address;
+        if(!resident->load_symbol(request.so,request.name,&address) ||
+           !address) {
+          std::cerr<<"Cannot load function:"<<request.name<<" of:"
+            <<request.so<<" through the agent, see log for detail!";
+          return false;
+        }
+        functions.push_back(address);
       }
+    } else if(!load_symbols(pinfo.get(),&alloc,requests,&functions)) {
+      std::cerr<<"Cannot load new functions in remote process, see log for "
+        "detail!";
+      return false;
+    }
 
-      patch* p = mgr.create_patch(
-            &alloc,
-            *pinfo,
-            hk.target,
-            new_function);
-      if(!p) {
-        std::cerr<<"Cannot create patch, see log for detail!";
-        return false;
+    for( size_t hook_index = 0 ; hook_index < hook_name_list.size() ;
+        ++hook_index ) {
+      const hook& hk = hook_name_list[hook_index];
+      const uintptr_t new_function = functions[hook_index*2];
+
+      if(name_index::is_pattern(hk.target)) {
+        std::vector<const process_info::symbol_info*> targets;
+        if(!pinfo->find_symbols(hk.target,&targets)) {
+          std::cerr<<"Invalid pattern:"<<hk.target<<", see log for detail!";
+          return false;
+        }
+        // A match that cannot be hooked is skipped , a pattern easily hits
+        // a function that is too short
+        size_t count = 0;
+        BOOST_FOREACH(const process_info::symbol_info* match, targets) {
+          const process_info::symbol_info* sinfo =
+            resolve_ifunc(pinfo.get(),*match);
+          std::auto_ptr<patch> p(sinfo ? mgr.create_patch(&alloc,*pinfo,
+                *sinfo,new_function) : NULL);
+          if(!p.get() || !p->check()) {
+            LOG(WARNING)<<"Skip function:"<<match->name<<" matched by:"
+              <<hk.target<<"!";
+            continue;
+          }
+          patch_list.push_back(p.release());
+          patch_hooks.push_back(hook_index);
+          ++count;
+        }
+        if(count == 0) {
+          std::cerr<<"No function matched by:"<<hk.target<<" can be hooked, "
+            "see log for detail!";
+          return false;
+        }
+        if(debug) {
+          std::cout<<"Pattern:"<<hk.target<<" hooks "<<count<<" of "
+            <<targets.size()<<" functions\n";
+        }
+      } else {
+        // An IFUNC like memcpy is hooked at the variant the process uses
+        const process_info::symbol_info* sinfo =
+          pinfo->find_symbol(hk.target);
+        if(!sinfo) {
+          std::cerr<<"Cannot find symbol:"<<hk.target<<", see log for "
+            "detail!";
+          return false;
+        }
+        sinfo = resolve_ifunc(pinfo.get(),*sinfo);
+        if(!sinfo) {
+          std::cerr<<"Cannot resolve IFUNC:"<<hk.target<<", see log for "
+            "detail!";
+          return false;
+        }
+        patch* p = mgr.create_patch(
+              &alloc,
+              *pinfo,
+              *sinfo,
+              new_function);
+        if(!p) {
+          std::cerr<<"Cannot create patch, see log for detail!";
+          return false;
+        }
+        // Do the check
+        if(!p->check()) {
+          std::cerr<<"Cannot do the patch since check doesn't pass, see log "
+            "for detail!";
+          delete p;
+          return false;
+        }
+
+        patch_list.push_back(p);
+        patch_hooks.push_back(hook_index);
       }
-      // Do the check
-      if(!p->check()) {
-        std::cerr<<"Cannot do the patch since check doesn't pass, see log for "
-          "detail!";
+      if(planned && !planner.poll()) {
+        std::cerr<<"Cannot serve the running process, see log for detail!";
         return false;
       }
-
-      patch_list.push_back(p);
     }
 
-    // Now perform all the patches
+    // Now prepare all the patches , the hook code is installed later
     size_t idx = 0 ;
+    std::vector<patch*> prepared_list;
+    std::vector<entry_call> entries;
     BOOST_FOREACH(patch& p , patch_list) {
       uintptr_t ret;
-      if(!p.perform(&ret)) {
+      if(!p.prepare(&ret)) {
         std::cerr<<"Failed to perform patches , see log for detail!";
         return false;
       }
+      prepared_list.push_back(&p);
+      entries.push_back(entry_call(functions[patch_hooks[idx]*2+1],ret,
+            p.target().base));
+      ++idx;
+      if(planned && !planner.poll()) {
+        std::cerr<<"Cannot serve the running process, see log for detail!";
+        return false;
+      }
+    }
 
-      boost::scoped_ptr<stub> setter(set_patched_func::create(
-          *pinfo,
-          hook_name_list[idx].path,
-          hook_name_list[idx].entry));
-      if(!setter) {
-        std::cerr<<"Cannot create set_patched_func stub code, see log for "
-          "detail!";
+    // Hand the original functions to every Entry in one invoke , or queue
+    // them all to the agent and wait for the last one
+    if(resident) {
+      uint32_t sequence = 0;
+      BOOST_FOREACH(const entry_call& call, entries) {
+        const uintptr_t args[2] = { call.original , call.target };
+        if(!resident->post_call(call.entry,args,2,&sequence)) {
+          std::cerr<<"Cannot queue the entry functions, see log for detail!";
+          return false;
+        }
+      }
+      if(!entries.empty() && !resident->wait(sequence)) {
+        std::cerr<<"Cannot invoke the entry functions, see log for detail!";
         return false;
       }
+    } else if(!call_entries(pinfo.get(),entries)) {
+      std::cerr<<"Cannot invoke the entry functions, see log for detail!";
+      return false;
+    }
 
-      uintptr_t ret_value;
-      if(!invoke(pinfo.get(),*setter,ret,&ret_value)) {
-        std::cerr<<"Cannot invoke set_patched_func code, see log for "
-          "detail!";
+    // In live mode the hook code is installed while the process is running.
+    // With a pause budget the hooks are installed in short stop windows.
+    // Otherwise move the threads out of all the prologues and install every
+    // hook within this stop window.
+    if(planned) {
+      if(!planner.install(prepared_list)) {
+        std::cerr<<"Failed to perform patches , see log for detail!";
         return false;
       }
-      if(ret_value) {
-        std::cerr<<"Invoke function:"<<hook_name_list[idx].entry<<" in "
-          <<hook_name_list[idx].path<<" failed, see log for detail!";
+    } else if(!live) {
+      if(!relocate_threads(pinfo.get(),prepared_list)) {
+        std::cerr<<"Cannot move threads out of patched functions, see log "
+          "for detail!";
         return false;
       }
-      ++idx;
+      BOOST_FOREACH(patch* p, prepared_list) {
+        if(!p->install()) {
+          std::cerr<<"Failed to perform patches , see log for detail!";
+          return false;
+        }
+      }
     }
 
     if(debug) {
+      std::cout<<"Load symbols takes:"<<pinfo->load_duration()<<" us\n";
       BOOST_FOREACH(patch& p, patch_list) {
         p.dump(std::cout);
       }
+      pinfo->memory()->dump(std::cout);
+      pinfo->shadow()->dump(std::cout);
+      if(resident) {
+        std::cout<<"Agent runs:"<<resident->command_count()<<" commands\n";
+      }
     }
 
     // resumse all the process and waiting for user to exit us
-    pinfo->resume_all();
+    if(!pinfo->resume_all()) {
+      std::cerr<<"Cannot resume the process, see log for detail!";
+      return false;
+    }
+
+    live_patcher lpatcher(pinfo.get());
+    if(live) {
+      if(!lpatcher.install(prepared_list)) {
+        std::cerr<<"Cannot install patches into running process, see log "
+          "for detail!";
+        return false;
+      }
+    }
 
     // now waiting here for user to notify us for exiting
     std::cout<<"Press any key to exit the process!";
     std::getchar();
 
-    // stop all process for recovery
-    pinfo->stop_all();
+    // Nothing needs the agent for the recovery , end it first
+    resident.reset();
+
+    // In live mode the hooks are removed with the process running, if it
+    // fails we stop all process for recovery like the normal mode
+    if(!live || !lpatcher.uninstall(prepared_list)) {
+      if(!planned || !planner.uninstall(prepared_list)) {
+        if(!pinfo->stop_all() ||
+           !relocate_threads(pinfo.get(),prepared_list)) {
+          std::cerr<<"Cannot stop the process for recovery, see log for "
+            "detail!";
+        }
+      }
+    }
+
+    if(debug && planned) planner.dump(std::cout);
+
+    // Recover the patched functions and flush them into target process
+    patch_list.clear();
+    if(!pinfo->commit_memory()) {
+      std::cerr<<"Cannot recover patched functions, see log for detail!";
+      return false;
+    }
 
     return true;
   }
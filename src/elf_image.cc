@@ -0,0 +1,142 @@
+#include "elf_image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <glog/logging.h>
+
+namespace dynhook {
+
+bool elf_image::init() {
+  base::scoped_fd fd( ::open(m_path.c_str(),O_RDONLY|O_CLOEXEC) );
+  if(!fd) {
+    LOG(ERROR)<<"Cannot open ELF file:"<<m_path<<" with error:"
+      <<std::strerror(errno);
+    return false;
+  }
+
+  struct stat st;
+  if(::fstat(fd.fd(),&st)) {
+    LOG(ERROR)<<"Cannot stat ELF file:"<<m_path<<" with error:"
+      <<std::strerror(errno);
+    return false;
+  }
+  if(static_cast<size_t>(st.st_size) < sizeof(Elf64_Ehdr)) {
+    LOG(ERROR)<<"File:"<<m_path<<" is too small to be an ELF file!";
+    return false;
+  }
+
+  void* addr = ::mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd.fd(),0);
+  if(addr == MAP_FAILED) {
+    LOG(ERROR)<<"Cannot mmap ELF file:"<<m_path<<" with error:"
+      <<std::strerror(errno);
+    return false;
+  }
+  m_data = static_cast<const char*>(addr);
+  m_size = static_cast<size_t>(st.st_size);
+
+  const Elf64_Ehdr& ehdr = header();
+  if(memcmp(ehdr.e_ident,ELFMAG,SELFMAG) != 0 ||
+     ehdr.e_ident[EI_CLASS] != ELFCLASS64) {
+    LOG(ERROR)<<"File:"<<m_path<<" is not an ELF64 file!";
+    return false;
+  }
+
+  // A stripped file may have no section header at all , which is fine
+  if(ehdr.e_shoff && ehdr.e_shnum) {
+    if(ehdr.e_shentsize != sizeof(Elf64_Shdr) ||
+       !at(ehdr.e_shoff,
+         static_cast<uint64_t>(ehdr.e_shnum)*sizeof(Elf64_Shdr))) {
+      LOG(ERROR)<<"File:"<<m_path<<" has broken section header table!";
+      return false;
+    }
+    m_sections = reinterpret_cast<const Elf64_Shdr*>(m_data+ehdr.e_shoff);
+    m_section_count = ehdr.e_shnum;
+  }
+
+  if(ehdr.e_phoff && ehdr.e_phnum) {
+    if(ehdr.e_phentsize != sizeof(Elf64_Phdr) ||
+       !at(ehdr.e_phoff,
+         static_cast<uint64_t>(ehdr.e_phnum)*sizeof(Elf64_Phdr))) {
+      LOG(ERROR)<<"File:"<<m_path<<" has broken program header table!";
+      return false;
+    }
+    m_segments = reinterpret_cast<const Elf64_Phdr*>(m_data+ehdr.e_phoff);
+    m_segment_count = ehdr.e_phnum;
+  }
+  return true;
+}
+
+void elf_image::release_pages() const {
+  if(m_data) ::madvise(const_cast<char*>(m_data),m_size,MADV_DONTNEED);
+}
+
+elf_image::~elf_image() {
+  if(m_data) {
+    ::munmap(const_cast<char*>(m_data),m_size);
+  }
+}
+
+const Elf64_Shdr* elf_image::section( size_t index ) const {
+  return index < m_section_count ? m_sections + index : NULL;
+}
+
+const Elf64_Shdr* elf_image::next_section( uint32_t type ,
+    const Elf64_Shdr* start ) const {
+  const Elf64_Shdr* end = m_sections + m_section_count;
+  for( const Elf64_Shdr* itr = start ? start + 1 : m_sections ;
+      itr < end ; ++itr ) {
+    if(itr->sh_type == type) return itr;
+  }
+  return NULL;
+}
+
+const Elf64_Phdr* elf_image::next_segment( uint32_t type ,
+    const Elf64_Phdr* start ) const {
+  const Elf64_Phdr* end = m_segments + m_segment_count;
+  for( const Elf64_Phdr* itr = start ? start + 1 : m_segments ;
+      itr < end ; ++itr ) {
+    if(itr->p_type == type) return itr;
+  }
+  return NULL;
+}
+
+const char* elf_image::at_vaddr( uint64_t vaddr , uint64_t len ) const {
+  for( const Elf64_Phdr* seg = next_segment(PT_LOAD) ; seg ;
+      seg = next_segment(PT_LOAD,seg) ) {
+    if(vaddr >= seg->p_vaddr && vaddr - seg->p_vaddr <= seg->p_filesz &&
+       len <= seg->p_filesz - (vaddr - seg->p_vaddr)) {
+      return at(seg->p_offset + (vaddr - seg->p_vaddr),len);
+    }
+  }
+  return NULL;
+}
+
+const Elf64_Sym* elf_image::symbols( const Elf64_Shdr& symtab ,
+    size_t* count ) const {
+  if(symtab.sh_entsize != sizeof(Elf64_Sym) ||
+     !at(symtab.sh_offset,symtab.sh_size)) {
+    LOG(ERROR)<<"File:"<<m_path<<" has broken symbol table!";
+    return NULL;
+  }
+  *count = symtab.sh_size / sizeof(Elf64_Sym);
+  return reinterpret_cast<const Elf64_Sym*>(m_data + symtab.sh_offset);
+}
+
+base::string_ref elf_image::symbol_name( const Elf64_Shdr& symtab ,
+    const Elf64_Sym& sym ) const {
+  const Elf64_Shdr* strtab = section(symtab.sh_link);
+  if(!strtab || sym.st_name >= strtab->sh_size) return base::string_ref();
+  const char* start = at(strtab->sh_offset,strtab->sh_size);
+  if(!start) return base::string_ref();
+  // The string table may not be terminated properly
+  const char* name = start + sym.st_name;
+  const void* nul = memchr(name,0,strtab->sh_size - sym.st_name);
+  if(!nul) return base::string_ref();
+  return base::string_ref(name,static_cast<const char*>(nul) - name);
+}
+
+} // namespace dynhook
@@ -0,0 +1,100 @@
+#ifndef ELF_IMAGE_H_
+#define ELF_IMAGE_H_
+#include "base.h"
+
+#include <elf.h>
+#include <string>
+#include <cstddef>
+#include <memory>
+#include <inttypes.h>
+#include <boost/noncopyable.hpp>
+
+namespace dynhook {
+
+// A read only mapping of an ELF64 file. Nothing is copied out of the file:
+// section headers , symbols and names are all pointers into the mapping ,
+// so they stay valid as long as the image is alive.
+class elf_image : private boost::noncopyable {
+ public:
+  static elf_image* create( const std::string& path ) {
+    std::auto_ptr<elf_image> ret( new elf_image(path) );
+    if(!ret->init()) return NULL;
+    return ret.release();
+  }
+
+  ~elf_image();
+
+  // Drop the pages we have touched from the resident set. The mapping stays
+  // valid , a later access reads the file again.
+  void release_pages() const;
+
+  const std::string& path() const {
+    return m_path;
+  }
+
+  const Elf64_Ehdr& header() const {
+    return *reinterpret_cast<const Elf64_Ehdr*>(m_data);
+  }
+
+  size_t section_count() const {
+    return m_section_count;
+  }
+
+  // NULL if the index is out of range
+  const Elf64_Shdr* section( size_t index ) const;
+
+  // The next section after start ( NULL means from the beginning ) that
+  // has the type , NULL if there's none
+  const Elf64_Shdr* next_section( uint32_t type ,
+      const Elf64_Shdr* start = NULL ) const;
+
+  // The next program header after start ( NULL means from the beginning )
+  // that has the type , NULL if there's none
+  const Elf64_Phdr* next_segment( uint32_t type ,
+      const Elf64_Phdr* start = NULL ) const;
+
+  // Pointer of [vaddr,vaddr+len) through the PT_LOAD segments , NULL if
+  // the range is not backed by the file
+  const char* at_vaddr( uint64_t vaddr , uint64_t len ) const;
+
+  // Symbols of a SHT_SYMTAB/SHT_DYNSYM section , NULL if the section is
+  // broken
+  const Elf64_Sym* symbols( const Elf64_Shdr& symtab , size_t* count ) const;
+
+  // Name of a symbol from the string table linked to the symbol section
+  // , an empty view if the name is out of range
+  base::string_ref symbol_name( const Elf64_Shdr& symtab ,
+      const Elf64_Sym& sym ) const;
+
+  // Pointer of [offset,offset+len) inside of the file , NULL if the range
+  // is out of the file
+  const char* at( uint64_t offset , uint64_t len ) const {
+    if(offset > m_size || len > m_size - offset) return NULL;
+    return m_data + offset;
+  }
+
+ private:
+  explicit elf_image( const std::string& path ):
+    m_path(path),
+    m_data(NULL),
+    m_size(0),
+    m_sections(NULL),
+    m_section_count(0),
+    m_segments(NULL),
+    m_segment_count(0)
+  {}
+
+  bool init();
+
+ private:
+  std::string m_path;
+  const char* m_data;
+  size_t m_size;
+  const Elf64_Shdr* m_sections;
+  size_t m_section_count;
+  const Elf64_Phdr* m_segments;
+  size_t m_segment_count;
+};
+
+} // namespace dynhook
+#endif // ELF_IMAGE_H_
@@ -0,0 +1,284 @@
+#include "frame_index.h"
+#include "elf_image.h"
+
+#include <elf.h>
+#include <cstring>
+
+#include <glog/logging.h>
+
+namespace dynhook {
+
+namespace {
+// Pointer encodings of the DWARF exception header , see the LSB
+enum {
+  DW_EH_PE_absptr  = 0x00,
+  DW_EH_PE_uleb128 = 0x01,
+  DW_EH_PE_udata2  = 0x02,
+  DW_EH_PE_udata4  = 0x03,
+  DW_EH_PE_udata8  = 0x04,
+  DW_EH_PE_sleb128 = 0x09,
+  DW_EH_PE_sdata2  = 0x0a,
+  DW_EH_PE_sdata4  = 0x0b,
+  DW_EH_PE_sdata8  = 0x0c,
+
+  DW_EH_PE_pcrel   = 0x10,
+  DW_EH_PE_datarel = 0x30,
+
+  DW_EH_PE_indirect= 0x80,
+  DW_EH_PE_omit    = 0xff
+};
+
+// Read cursor over the mapped bytes that knows the virtual address of
+// what it points to , which pc relative pointers are relative to
+struct cursor {
+  const char* p;
+  const char* end;
+  uint64_t vaddr;
+
+  cursor( const char* start , size_t len , uint64_t v ):
+    p(start),
+    end(start + len),
+    vaddr(v)
+  {}
+
+  bool skip( size_t len ) {
+    if(static_cast<size_t>(end - p) < len) return false;
+    p += len;
+    vaddr += len;
+    return true;
+  }
+
+  template< typename T >
+  bool read( T* output ) {
+    if(static_cast<size_t>(end - p) < sizeof(T)) return false;
+    memcpy(output,p,sizeof(T));
+    return skip(sizeof(T));
+  }
+
+  bool read_uleb( uint64_t* output ) {
+    uint64_t ret = 0;
+    for( unsigned shift = 0 ; p != end && shift < 64 ; shift += 7 ) {
+      const uint8_t byte = static_cast<uint8_t>(*p);
+      skip(1);
+      ret |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if(!(byte & 0x80)) {
+        *output = ret;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool read_sleb( int64_t* output ) {
+    int64_t ret = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+      if(p == end || shift >= 64) return false;
+      byte = static_cast<uint8_t>(*p);
+      skip(1);
+      ret |= static_cast<int64_t>(byte & 0x7f) << shift;
+      shift += 7;
+    } while(byte & 0x80);
+    if(shift < 64 && (byte & 0x40)) ret |= -(static_cast<int64_t>(1) << shift);
+    *output = ret;
+    return true;
+  }
+
+  // A pointer in the encoding. Only what the toolchains emit for the
+  // fields we need is supported : no indirect and no aligned pointer.
+  bool read_encoded( uint8_t encoding , uint64_t data , uint64_t* output ) {
+    if(encoding == DW_EH_PE_omit || (encoding & DW_EH_PE_indirect))
+      return false;
+    const uint64_t field = vaddr;
+    uint64_t value;
+    switch(encoding & 0x0f) {
+      case DW_EH_PE_absptr:
+      case DW_EH_PE_udata8:
+      case DW_EH_PE_sdata8: {
+        uint64_t v; if(!read(&v)) return false; value = v; break;
+      }
+      case DW_EH_PE_udata2: {
+        uint16_t v; if(!read(&v)) return false; value = v; break;
+      }
+      case DW_EH_PE_sdata2: {
+        int16_t v; if(!read(&v)) return false; value = v; break;
+      }
+      case DW_EH_PE_udata4: {
+        uint32_t v; if(!read(&v)) return false; value = v; break;
+      }
+      case DW_EH_PE_sdata4: {
+        int32_t v; if(!read(&v)) return false; value = v; break;
+      }
+      case DW_EH_PE_uleb128:
+        if(!read_uleb(&value)) return false;
+        break;
+      case DW_EH_PE_sleb128: {
+        int64_t v; if(!read_sleb(&v)) return false; value = v; break;
+      }
+      default:
+        return false;
+    }
+    switch(encoding & 0x70) {
+      case 0: break;
+      case DW_EH_PE_pcrel: value += field; break;
+      case DW_EH_PE_datarel: value += data; break;
+      default: return false;
+    }
+    *output = value;
+    return true;
+  }
+};
+
+// Length field of a CIE/FDE , the record is [vaddr,vaddr+*size)
+bool record_size( const elf_image& image , uint64_t vaddr , uint64_t* size ) {
+  const char* p = image.at_vaddr(vaddr,sizeof(uint32_t));
+  if(!p) return false;
+  uint32_t length;
+  memcpy(&length,p,sizeof(length));
+  if(length == 0) return false;  // Terminator
+  if(length != 0xffffffff) {
+    *size = sizeof(uint32_t) + length;
+    return true;
+  }
+  p = image.at_vaddr(vaddr,sizeof(uint32_t) + sizeof(uint64_t));
+  if(!p) return false;
+  uint64_t extended;
+  memcpy(&extended,p + sizeof(uint32_t),sizeof(extended));
+  *size = sizeof(uint32_t) + sizeof(uint64_t) + extended;
+  return *size > extended;
+}
+
+// Cursor over the body of a record , right after the length field
+bool open_record( const elf_image& image , uint64_t vaddr , cursor* output ) {
+  uint64_t size;
+  if(!record_size(image,vaddr,&size)) return false;
+  const char* p = image.at_vaddr(vaddr,size);
+  if(!p) return false;
+  *output = cursor(p,size,vaddr);
+  uint32_t length;
+  output->read(&length);
+  return length != 0xffffffff || output->skip(sizeof(uint64_t));
+}
+} // namespace
+
+bool frame_index::init() {
+  const Elf64_Phdr* seg = m_image.next_segment(PT_GNU_EH_FRAME);
+  if(!seg) return false;
+  m_hdr = seg->p_vaddr;
+  const char* hdr = m_image.at_vaddr(seg->p_vaddr,seg->p_filesz);
+  if(!hdr) return false;
+
+  // version , eh_frame_ptr_enc , fde_count_enc , table_enc
+  cursor c(hdr,seg->p_filesz,seg->p_vaddr);
+  uint8_t version , frame_enc , count_enc , table_enc;
+  if(!c.read(&version) || !c.read(&frame_enc) || !c.read(&count_enc) ||
+     !c.read(&table_enc) || version != 1)
+    return false;
+  uint64_t frame , count;
+  if(!c.read_encoded(frame_enc,m_hdr,&frame) ||
+     !c.read_encoded(count_enc,m_hdr,&count))
+    return false;
+  if(table_enc != (DW_EH_PE_datarel|DW_EH_PE_sdata4)) {
+    LOG(WARNING)<<"File:"<<m_image.path()<<" has .eh_frame_hdr table "
+      "encoding:"<<static_cast<unsigned>(table_enc)<<" we don't support!";
+    return false;
+  }
+  if(count > static_cast<uint64_t>(c.end - c.p) / sizeof(table_entry))
+    return false;
+  m_table = reinterpret_cast<const table_entry*>(c.p);
+  m_count = static_cast<size_t>(count);
+  return m_count != 0;
+}
+
+bool frame_index::find( uint64_t vaddr , uint64_t* start ,
+    uint64_t* size ) const {
+  // Last entry that starts at or below the address
+  const int64_t key = static_cast<int64_t>(vaddr - m_hdr);
+  size_t lo = 0 , hi = m_count;
+  while(lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if(m_table[mid].start <= key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if(lo == 0) return false;
+  const table_entry& entry = m_table[lo-1];
+  if(!decode_fde(m_hdr + entry.fde,start,size)) return false;
+  // There are gaps between functions without unwind information
+  return vaddr >= *start && vaddr - *start < *size;
+}
+
+bool frame_index::decode_fde( uint64_t vaddr , uint64_t* start ,
+    uint64_t* size ) const {
+  cursor c(NULL,0,0);
+  if(!open_record(m_image,vaddr,&c)) return false;
+
+  // The CIE pointer is relative to the field itself , 0 means a CIE
+  const uint64_t field = c.vaddr;
+  uint32_t cie;
+  if(!c.read(&cie) || cie == 0) return false;
+  uint8_t encoding;
+  if(!decode_cie(field - cie,&encoding)) return false;
+
+  // The range uses the format of the encoding without its application
+  return c.read_encoded(encoding,m_hdr,start) &&
+    c.read_encoded(encoding & 0x0f,m_hdr,size);
+}
+
+bool frame_index::decode_cie( uint64_t vaddr , uint8_t* encoding ) const {
+  cursor c(NULL,0,0);
+  if(!open_record(m_image,vaddr,&c)) return false;
+
+  uint32_t id;
+  uint8_t version;
+  if(!c.read(&id) || id != 0 || !c.read(&version)) return false;
+  const char* augmentation = c.p;
+  const void* nul = memchr(c.p,0,c.end - c.p);
+  if(!nul || !c.skip(static_cast<const char*>(nul) - c.p + 1)) return false;
+
+  uint64_t code_align , return_reg;
+  int64_t data_align;
+  if(!c.read_uleb(&code_align) || !c.read_sleb(&data_align)) return false;
+  if(version == 1) {
+    uint8_t reg;
+    if(!c.read(&reg)) return false;
+  } else if(!c.read_uleb(&return_reg)) {
+    return false;
+  }
+
+  // Without 'R' the FDE uses absolute pointers
+  *encoding = DW_EH_PE_absptr;
+  if(augmentation[0] != 'z') return augmentation[0] == 0;
+  uint64_t length;
+  if(!c.read_uleb(&length)) return false;
+  for( const char* a = augmentation + 1 ; *a ; ++a ) {
+    switch(*a) {
+      case 'R':
+        return c.read(encoding);
+      case 'L': {
+        uint8_t lsda;
+        if(!c.read(&lsda)) return false;
+        break;
+      }
+      case 'P': {
+        uint8_t personality;
+        uint64_t routine;
+        if(!c.read(&personality) ||
+           !c.read_encoded(personality & ~DW_EH_PE_indirect,m_hdr,&routine))
+          return false;
+        break;
+      }
+      case 'S':
+      case 'B':
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+} // namespace dynhook
@@ -0,0 +1,69 @@
+#ifndef FRAME_INDEX_H_
+#define FRAME_INDEX_H_
+#include "base.h"
+
+#include <cstddef>
+#include <memory>
+#include <inttypes.h>
+#include <boost/noncopyable.hpp>
+
+namespace dynhook {
+class elf_image;
+
+// Function boundaries of a module from its unwind information. Every
+// function the compiler emits has an FDE in .eh_frame , stripped or not,
+// and the linker sorts the start address of each FDE into the binary
+// search table of .eh_frame_hdr ( PT_GNU_EH_FRAME ). Nothing is copied :
+// a lookup is one binary search over that table in the mapped file and
+// the decoding of the FDE it lands on , which tells where the function
+// ends. Addresses are link time virtual addresses , like st_value.
+class frame_index : private boost::noncopyable {
+ public:
+  // NULL if the file has no PT_GNU_EH_FRAME or the table is not in the
+  // format the linkers emit
+  static frame_index* create( const elf_image& image ) {
+    std::auto_ptr<frame_index> ret( new frame_index(image) );
+    if(!ret->init()) return NULL;
+    return ret.release();
+  }
+
+  // The function that covers the address , false if no FDE covers it
+  bool find( uint64_t vaddr , uint64_t* start , uint64_t* size ) const;
+
+  // Number of FDEs in the table
+  size_t size() const {
+    return m_count;
+  }
+
+ private:
+  // An entry of the binary search table , both fields are relative to
+  // the start of .eh_frame_hdr ( DW_EH_PE_datarel|DW_EH_PE_sdata4 )
+  struct table_entry {
+    int32_t start;
+    int32_t fde;
+  };
+
+  explicit frame_index( const elf_image& image ):
+    m_image(image),
+    m_hdr(0),
+    m_table(NULL),
+    m_count(0)
+  {}
+
+  bool init();
+
+  // Range of the FDE at the virtual address
+  bool decode_fde( uint64_t vaddr , uint64_t* start , uint64_t* size ) const;
+
+  // Pointer encoding of the FDEs that belong to the CIE
+  bool decode_cie( uint64_t vaddr , uint8_t* encoding ) const;
+
+ private:
+  const elf_image& m_image;
+  uint64_t m_hdr; // Virtual address of .eh_frame_hdr
+  const table_entry* m_table;
+  size_t m_count;
+};
+
+} // namespace dynhook
+#endif // FRAME_INDEX_H_
@@ -0,0 +1,52 @@
+#include "function_analysis.h"
+
+#include <algorithm>
+
+namespace dynhook {
+
+uint32_t function_analysis::hash_prologue( const char* code , size_t size ) {
+  // FNV-1a over the prologue and the size
+  uint32_t h = 2166136261U;
+  const size_t len = std::min(size,kPrologueSize);
+  for( size_t i = 0 ; i < len ; ++i ) {
+    h ^= static_cast<unsigned char>(code[i]);
+    h *= 16777619U;
+  }
+  return h ^ static_cast<uint32_t>(size);
+}
+
+function_analysis function_analysis::analyze( const char* code ,
+    size_t size ) {
+  function_analysis ret;
+  ret.prologue_hash = hash_prologue(code,size);
+
+  size_t pos = 0;
+  while(pos < size) {
+    struct insn insn;
+    const int avail = static_cast<int>(std::min<size_t>(MAX_INSN_SIZE,
+          size - pos));
+    insn_init(&insn,code+pos,avail,1);
+    insn_get_length(&insn);
+    if(insn.length == 0 || pos + insn.length > size) {
+      ret.flags |= UNDECODABLE;
+      break;
+    }
+    if(pos < kPrologueSize) ret.boundaries |= 1U << pos;
+
+    if(insn_is_indirect_jmp(insn)) {
+      ret.flags |= INDIRECT_JUMP;
+    } else if(insn_is_jmp_instruction(insn)) {
+      insn_get_immediate(&insn);
+      const int64_t target = static_cast<int64_t>(pos + insn.length) +
+        insn.immediate.value;
+      if(target >= 0 && target < kNoJump) {
+        ret.jump_floor = std::min(ret.jump_floor,
+            static_cast<uint16_t>(target));
+      }
+    }
+    pos += insn.length;
+  }
+  return ret;
+}
+
+} // namespace dynhook
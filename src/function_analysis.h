@@ -0,0 +1,91 @@
+#ifndef FUNCTION_ANALYSIS_H_
+#define FUNCTION_ANALYSIS_H_
+#include <cstddef>
+#include <inttypes.h>
+
+#include "../instr/insn.h"
+
+namespace dynhook {
+
+inline bool insn_is_indirect_jmp( const struct insn& insn ) {
+  return ((insn.opcode.bytes[0] == 0xff &&
+           (X86_MODRM_REG(insn.modrm.value) & 6) == 4) ||
+           insn.opcode.bytes[0] == 0xea);
+}
+
+inline bool insn_is_jmp_instruction( const struct insn& insn ) {
+  switch(insn.opcode.bytes[0]) {
+    case 0xe0: /* loopne */
+    case 0xe1: /* loope */
+    case 0xe2: /* loop */
+    case 0xe3: /* jcxz */
+    case 0xe9: /* near relative jump */
+    case 0xeb: /* short relative jump */
+      return true;
+    case 0x0f:
+      if((insn.opcode.bytes[1] &0xf0) == 0x80)
+        return true;
+      return false;
+    default:
+      if((insn.opcode.bytes[0] &0xf0) == 0x70)
+        return true;
+      return false;
+  }
+}
+
+// What we need to know about a function body to hook it. It only depends
+// on the code bytes , so it can be computed once per ELF file and cached ,
+// see symbol_cache. The layout is part of the cache file format.
+struct function_analysis {
+  enum {
+    INDIRECT_JUMP = 1 , // Has an indirect jump , maybe a jump table
+    UNDECODABLE   = 2   // Has bytes we cannot decode
+  };
+
+  // Bit i is set if an instruction starts at offset i
+  uint32_t boundaries;
+
+  // Hash of the first kPrologueSize bytes , tells whether the code still
+  // is what the analysis was done for
+  uint32_t prologue_hash;
+
+  // Lowest offset inside of the function that a direct jump targets ,
+  // kNoJump if there's none
+  uint16_t jump_floor;
+  uint16_t flags;
+
+  static const size_t kPrologueSize = 32;
+  static const uint16_t kNoJump = 0xffff;
+
+  function_analysis():
+    boundaries(0),
+    prologue_hash(0),
+    jump_floor(kNoJump),
+    flags(0)
+  {}
+
+  // Whether the first patch_size bytes can be overwritten : nothing in the
+  // body jumps back into them
+  bool patchable( size_t patch_size ) const {
+    return flags == 0 && jump_floor > patch_size;
+  }
+
+  // Whether an instruction starts at the offset , only known for the
+  // prologue
+  bool boundary( size_t offset ) const {
+    return offset < kPrologueSize && (boundaries & (1U << offset));
+  }
+
+  // Whether the analysis describes this code
+  bool matches( const char* code , size_t size ) const {
+    return prologue_hash == hash_prologue(code,size);
+  }
+
+  static uint32_t hash_prologue( const char* code , size_t size );
+
+  // Decode the whole body
+  static function_analysis analyze( const char* code , size_t size );
+};
+
+} // namespace dynhook
+#endif // FUNCTION_ANALYSIS_H_
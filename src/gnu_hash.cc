@@ -0,0 +1,141 @@
+#include "gnu_hash.h"
+#include "elf_image.h"
+#include "remote_memory.h"
+
+#include <cstring>
+#include <algorithm>
+#include <boost/scoped_array.hpp>
+#include <glog/logging.h>
+
+namespace dynhook {
+
+bool image_reader::read( uint64_t vaddr , void* buf , size_t len ) const {
+  const char* src = m_image.at_vaddr(vaddr,len);
+  if(!src) return false;
+  memcpy(buf,src,len);
+  return true;
+}
+
+uint64_t image_reader::dynamic() const {
+  const Elf64_Phdr* seg = m_image.next_segment(PT_DYNAMIC);
+  return seg ? seg->p_vaddr : 0;
+}
+
+bool remote_reader::read( uint64_t vaddr , void* buf , size_t len ) const {
+  return m_memory->read(m_bias + vaddr,buf,len);
+}
+
+uint32_t gnu_hash_resolver::hash( const char* name ) {
+  uint32_t h = 5381;
+  for( const unsigned char* c = reinterpret_cast<const unsigned char*>(name);
+      *c ; ++c ) {
+    h = (h << 5) + h + *c;
+  }
+  return h;
+}
+
+bool gnu_hash_resolver::init( uint64_t dynamic , uintptr_t bias ) {
+  if(!dynamic) return false;
+
+  uint64_t gnu_hash = 0;
+  for( uint64_t addr = dynamic ; ; addr += sizeof(Elf64_Dyn) ) {
+    Elf64_Dyn dyn;
+    if(!m_reader->read(addr,&dyn,sizeof(dyn))) return false;
+    if(dyn.d_tag == DT_NULL) break;
+    // A pointer relocated by the dynamic linker is an absolute address
+    uint64_t ptr = dyn.d_un.d_ptr;
+    if(bias && ptr >= bias) ptr -= bias;
+    switch(dyn.d_tag) {
+      case DT_GNU_HASH: gnu_hash = ptr; break;
+      case DT_SYMTAB:   m_symtab = ptr; break;
+      case DT_STRTAB:   m_strtab = ptr; break;
+      case DT_STRSZ:    m_strsz = dyn.d_un.d_val; break;
+      default: break;
+    }
+  }
+  if(!gnu_hash || !m_symtab || !m_strtab) return false;
+
+  uint32_t header[4];
+  if(!m_reader->read(gnu_hash,header,sizeof(header))) return false;
+  m_nbuckets = header[0];
+  m_symoffset = header[1];
+  m_bloom_size = header[2];
+  m_bloom_shift = header[3];
+  if(m_nbuckets == 0 || m_bloom_size == 0 ||
+     (m_bloom_size & (m_bloom_size-1))) {
+    LOG(WARNING)<<"Broken DT_GNU_HASH table!";
+    return false;
+  }
+
+  m_bloom = gnu_hash + sizeof(header);
+  m_buckets = m_bloom + static_cast<uint64_t>(m_bloom_size)*sizeof(uint64_t);
+  m_chain = m_buckets + static_cast<uint64_t>(m_nbuckets)*sizeof(uint32_t);
+  return true;
+}
+
+bool gnu_hash_resolver::lookup( const char* name , Elf64_Sym* output ) const {
+  const uint32_t h1 = hash(name);
+
+  // 1. Bloom filter , most misses stop here
+  uint64_t word;
+  if(!m_reader->read(m_bloom + ((h1 / 64) & (m_bloom_size - 1)) *
+        sizeof(uint64_t),&word,sizeof(word)))
+    return false;
+  const uint64_t mask = (static_cast<uint64_t>(1) << (h1 % 64)) |
+    (static_cast<uint64_t>(1) << ((h1 >> m_bloom_shift) % 64));
+  if((word & mask) != mask) return false;
+
+  // 2. Bucket
+  uint32_t index;
+  if(!m_reader->read(m_buckets + (h1 % m_nbuckets) * sizeof(uint32_t),
+        &index,sizeof(index)))
+    return false;
+  if(index < m_symoffset) return false;
+
+  // 3. Chain , the lowest bit marks the end of the chain
+  const size_t len = strlen(name);
+  boost::scoped_array<char> buffer( new char[len+1] );
+  for( ; ; ++index ) {
+    uint32_t h2;
+    if(!m_reader->read(m_chain + (index - m_symoffset) * sizeof(uint32_t),
+          &h2,sizeof(h2)))
+      return false;
+    if((h1 | 1) == (h2 | 1)) {
+      Elf64_Sym sym;
+      if(!m_reader->read(m_symtab + index * sizeof(Elf64_Sym),&sym,
+            sizeof(sym)))
+        return false;
+      if(sym.st_shndx != SHN_UNDEF &&
+         (!m_strsz || sym.st_name + len + 1 <= m_strsz) &&
+         m_reader->read(m_strtab + sym.st_name,buffer.get(),len+1) &&
+         memcmp(buffer.get(),name,len+1) == 0) {
+        *output = sym;
+        return true;
+      }
+    }
+    if(h2 & 1) break;
+  }
+  return false;
+}
+
+size_t gnu_hash_resolver::symbol_count() const {
+  std::vector<uint32_t> buckets(m_nbuckets);
+  if(!m_reader->read(m_buckets,&buckets[0],m_nbuckets*sizeof(uint32_t)))
+    return 0;
+  uint32_t last = 0;
+  for( size_t i = 0 ; i < buckets.size() ; ++i )
+    last = std::max(last,buckets[i]);
+  if(last < m_symoffset) return m_symoffset;
+
+  // Walk the chain of the highest bucket to its end
+  for( ; ; ++last ) {
+    uint32_t h;
+    if(!m_reader->read(m_chain + (last - m_symoffset) * sizeof(uint32_t),
+          &h,sizeof(h)))
+      return 0;
+    if(h & 1) break;
+  }
+  return static_cast<size_t>(last) + 1;
+}
+
+} // namespace dynhook
@@ -0,0 +1,126 @@
+#ifndef GNU_HASH_H_
+#define GNU_HASH_H_
+#include "base.h"
+
+#include <elf.h>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <inttypes.h>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+
+namespace dynhook {
+class elf_image;
+class remote_memory;
+
+// Read the memory of an ELF module by its link time virtual address , which
+// is the address space st_value and p_vaddr live in.
+class elf_reader {
+ public:
+  virtual bool read( uint64_t vaddr , void* buf , size_t len ) const = 0;
+  virtual ~elf_reader() {}
+};
+
+// A module in a local mapped file , see elf_image
+class image_reader : public elf_reader {
+ public:
+  explicit image_reader( const elf_image& image ):
+    m_image(image)
+  {}
+
+  virtual bool read( uint64_t vaddr , void* buf , size_t len ) const;
+
+  // Virtual address of the dynamic section , 0 if there's none
+  uint64_t dynamic() const;
+
+ private:
+  const elf_image& m_image;
+};
+
+// A module loaded into the remote process with the load bias
+class remote_reader : public elf_reader {
+ public:
+  remote_reader( remote_memory* memory , uintptr_t bias ):
+    m_memory(memory),
+    m_bias(bias)
+  {}
+
+  virtual bool read( uint64_t vaddr , void* buf , size_t len ) const;
+
+ private:
+  remote_memory* m_memory;
+  uintptr_t m_bias;
+};
+
+// Look up dynamic symbols with the DT_GNU_HASH table of a module, the same
+// way the dynamic linker does. Nothing is loaded up front except the hash
+// header ; one lookup costs a bloom filter word , a bucket , the chain
+// entries of the bucket and the symbol/name that matches the hash. For a
+// remote module that is a handful of reads instead of the whole dynsym.
+class gnu_hash_resolver : private boost::noncopyable {
+ public:
+  // The reader is owned by the resolver. dynamic is the address of the
+  // dynamic section. The dynamic linker may have relocated the pointers in
+  // the dynamic section of a loaded module , bias is used to turn them
+  // back into virtual addresses ; use 0 for a file. NULL is returned if
+  // the module doesn't have DT_GNU_HASH.
+  static gnu_hash_resolver* create( elf_reader* reader , uint64_t dynamic ,
+      uintptr_t bias = 0 ) {
+    std::auto_ptr<gnu_hash_resolver> ret( new gnu_hash_resolver(reader) );
+    if(!ret->init(dynamic,bias)) return NULL;
+    return ret.release();
+  }
+
+  // Find a symbol that is defined by this module
+  bool lookup( const char* name , Elf64_Sym* output ) const;
+
+  // Number of entries of the dynamic symbol table , which is where the
+  // longest chain of the last bucket ends. 0 if the table cannot be read.
+  size_t symbol_count() const;
+
+  // Virtual address of the dynamic symbol table and its string table
+  uint64_t symtab() const { return m_symtab; }
+  uint64_t strtab() const { return m_strtab; }
+  uint64_t strsz() const { return m_strsz; }
+
+  static uint32_t hash( const char* name );
+
+ private:
+  explicit gnu_hash_resolver( elf_reader* reader ):
+    m_reader(reader),
+    m_symtab(0),
+    m_strtab(0),
+    m_strsz(0),
+    m_nbuckets(0),
+    m_symoffset(0),
+    m_bloom_size(0),
+    m_bloom_shift(0),
+    m_bloom(0),
+    m_buckets(0),
+    m_chain(0)
+  {}
+
+  bool init( uint64_t dynamic , uintptr_t bias );
+
+ private:
+  boost::scoped_ptr<elf_reader> m_reader;
+
+  uint64_t m_symtab;
+  uint64_t m_strtab;
+  uint64_t m_strsz;
+
+  // Header of the hash table
+  uint32_t m_nbuckets;
+  uint32_t m_symoffset;
+  uint32_t m_bloom_size;
+  uint32_t m_bloom_shift;
+
+  // Where the parts of the hash table are
+  uint64_t m_bloom;
+  uint64_t m_buckets;
+  uint64_t m_chain;
+};
+
+} // namespace dynhook
+#endif // GNU_HASH_H_
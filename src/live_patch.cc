@@ -0,0 +1,184 @@
+#include "live_patch.h"
+#include "patch.h"
+#include "remote_memory.h"
+#include "shadow_memory.h"
+
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <string>
+
+#include <glog/logging.h>
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+
+namespace dynhook {
+
+namespace {
+const char kInt3 = static_cast<char>(0xcc);
+
+// After the last stage , a thread may still be on its way to report the
+// trap it hits before the int3 goes away. Keep serving traps this long.
+const uint64_t kGraceTime = 10000;
+
+// Move the threads out of the bytes we are going to overwrite
+class thread_mover : public process_info::thread_visitor {
+ public:
+  explicit thread_mover( const std::vector<patch*>& patches ):
+    m_patches(patches)
+  {}
+
+  virtual bool visit( pid_t pid , struct user_regs_struct* regs ,
+      bool* modified ) {
+    BOOST_FOREACH(patch* p, m_patches) {
+      const uintptr_t rip = regs->rip;
+      if(p->move_thread(regs)) {
+        LOG(INFO)<<"Move thread:"<<pid<<" from:"<<std::hex<<rip
+          <<" to:"<<regs->rip<<std::dec<<" for patching:"<<p->target().name;
+        *modified = true;
+        break;
+      }
+    }
+    return true;
+  }
+
+ private:
+  const std::vector<patch*>& m_patches;
+};
+} // namespace
+
+bool live_patcher::sync_cores() {
+  // A user space tracer cannot send IPI. Instead we get ourself scheduled
+  // on every CPU the process may run on in turn : the thread running there
+  // is preempted , and it returns to user space through a serializing
+  // instruction. It is the same guarantee the kernel gets from sync_core()
+  // for text poking.
+  cpu_set_t target;
+  if(!m_pinfo->cpu_affinity(&target)) return false;
+  cpu_set_t old_set;
+  if(::sched_getaffinity(0,sizeof(old_set),&old_set)) {
+    LOG(ERROR)<<"sched_getaffinity failed with:"<<std::strerror(errno);
+    return false;
+  }
+  bool ret = true;
+  std::string synced;
+  for( int i = 0 ; i < CPU_SETSIZE ; ++i ) {
+    if(!CPU_ISSET(i,&target)) continue;
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(i,&one);
+    if(::sched_setaffinity(0,sizeof(one),&one)) {
+      // Outside of our cpuset , a stale instruction may still run there
+      LOG(ERROR)<<"Cannot run on CPU:"<<i<<" which process:"
+        <<m_pinfo->pid()<<" may run on , sched_setaffinity failed with:"
+        <<std::strerror(errno);
+      ret = false;
+      break;
+    }
+    ::sched_yield();
+    synced += (boost::format(" %d") % i).str();
+  }
+  if(::sched_setaffinity(0,sizeof(old_set),&old_set)) {
+    LOG(ERROR)<<"sched_setaffinity failed with:"<<std::strerror(errno);
+    return false;
+  }
+  if(ret) LOG(INFO)<<"Sync CPU:"<<synced<<"!";
+  return ret;
+}
+
+bool live_patcher::flush() {
+  if(!m_pinfo->commit_memory()) return false;
+  if(!sync_cores()) return false;
+  return m_pinfo->service_traps(0);
+}
+
+bool live_patcher::apply( const std::vector<patch*>& patches ,
+    bool install ) {
+  // 1. Put int3 on every target
+  BOOST_FOREACH(patch* p, patches) {
+    if(!m_pinfo->shadow()->write(p->m_target.base,&kInt3,1))
+      return false;
+  }
+  if(!flush()) return false;
+
+  // 2. Nobody can enter the targets now , move the threads that are
+  // already inside
+  thread_mover mover(patches);
+  if(!m_pinfo->visit_threads(&mover)) return false;
+
+  // 3. Write the tail
+  BOOST_FOREACH(patch* p, patches) {
+    const char* code = install ? p->hook_code() : p->m_func_code.get();
+    const size_t len = install ? p->hook_code_size() : p->m_hook_size;
+    if(install) {
+      // From now on the body needs recovery
+      p->m_body_modified = true;
+      p->m_hook_size = len;
+    }
+    if(!m_pinfo->shadow()->write(p->m_target.base+1,code+1,len-1))
+      return false;
+  }
+  if(!flush()) return false;
+
+  // 4. Write the first byte
+  BOOST_FOREACH(patch* p, patches) {
+    const char* code = install ? p->hook_code() : p->m_func_code.get();
+    if(!m_pinfo->shadow()->write(p->m_target.base,code,1))
+      return false;
+  }
+  if(!flush()) return false;
+
+  if(!install) {
+    BOOST_FOREACH(patch* p, patches) {
+      p->m_body_modified = false;
+    }
+  }
+  return true;
+}
+
+bool live_patcher::run( const std::vector<patch*>& patches , bool install ) {
+  if(m_pinfo->memory()->backend() != remote_memory::PROC_MEM) {
+    LOG(ERROR)<<"Patching a running process requires the procmem backend "
+      "since the text cannot be written otherwise!";
+    return false;
+  }
+
+  // A thread that hits the temporary int3 goes where the code we are
+  // writing would take it to
+  process_info::trap_map traps;
+  BOOST_FOREACH(patch* p, patches) {
+    traps[p->m_target.base] = install ? p->hook_destination() :
+      p->m_patched_entry;
+  }
+
+  const uint64_t start = base::monotonic_us();
+  // A thread we don't trace gets a real SIGTRAP from the int3 , which
+  // kills the process. Seize the threads created since resume_all and
+  // follow the clones until the int3 are gone.
+  if(!m_pinfo->follow_clones(true)) {
+    m_pinfo->follow_clones(false);
+    return false;
+  }
+  m_pinfo->set_trap_routes(&traps);
+  bool ret = apply(patches,install);
+  // Serve the late traps whatever happens , otherwise they get SIGTRAP
+  if(!m_pinfo->service_traps(kGraceTime)) ret = false;
+  m_pinfo->set_trap_routes(NULL);
+  if(!m_pinfo->follow_clones(false)) ret = false;
+
+  LOG(INFO)<<(install ? "Install " : "Uninstall ")<<patches.size()
+    <<" patches into running process:"<<m_pinfo->pid()<<" in "
+    <<base::monotonic_us() - start<<" us!";
+  return ret;
+}
+
+bool live_patcher::install( const std::vector<patch*>& patches ) {
+  return run(patches,true);
+}
+
+bool live_patcher::uninstall( const std::vector<patch*>& patches ) {
+  return run(patches,false);
+}
+
+} // namespace dynhook
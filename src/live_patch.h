@@ -0,0 +1,59 @@
+#ifndef LIVE_PATCH_H_
+#define LIVE_PATCH_H_
+#include "process_info.h"
+
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace dynhook {
+class patch;
+
+// Install/recover hooks while the target process keeps running. This is
+// the cross modifying code protocol used by kernel text poking:
+//
+// 1) Write an int3 on the first byte of each target function and sync all
+// the cores. From now on a thread entering the function traps.
+// 2) Move every thread that is already inside of the bytes we are going to
+// overwrite to the relocated copy in the detour buffer. The threads are
+// visited one by one , so only one thread is stopped at any time.
+// 3) Write the tail of the hook code and sync all the cores.
+// 4) Write the final first byte and sync all the cores.
+//
+// All the threads are seized by us , including the ones created while the
+// protocol runs since we follow the clones , so a thread that hits the
+// temporary int3 reports a SIGTRAP stop to the tracer instead of getting
+// the signal.
+// The tracer then resumes it at the place the finished hook would take it
+// to. This is our SIGTRAP handler ; nothing is injected into the target.
+//
+// All the patches must be prepared ( patch::prepare ) and every thread
+// must be seized and running. The remote memory backend must be able to
+// write text without stopping the process , which means PROC_MEM.
+class live_patcher : private boost::noncopyable {
+ public:
+  explicit live_patcher( process_info* pinfo ):
+    m_pinfo(pinfo)
+  {}
+
+  bool install( const std::vector<patch*>& patches );
+
+  // Recover the original bytes of installed patches with the same protocol
+  bool uninstall( const std::vector<patch*>& patches );
+
+ private:
+  bool run( const std::vector<patch*>& patches , bool install );
+  bool apply( const std::vector<patch*>& patches , bool install );
+
+  // Write the shadow into the target process and sync all the cores
+  bool flush();
+
+  // Make sure no core the process may run on executes stale instruction
+  // bytes , fails if we cannot run on one of them
+  bool sync_cores();
+
+ private:
+  process_info* m_pinfo;
+};
+
+} // namespace dynhook
+#endif // LIVE_PATCH_H_
@@ -0,0 +1,309 @@
+#include "name_index.h"
+#include "symbol_table.h"
+
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <cxxabi.h>
+#include <fnmatch.h>
+#include <regex.h>
+
+#include <glog/logging.h>
+#include <boost/foreach.hpp>
+
+namespace dynhook {
+
+namespace {
+// Length of the name without the parameter list and the qualifiers that
+// follow it , the whole name if it doesn't look like a function signature
+size_t function_length( const char* name , size_t len ) {
+  size_t end = len;
+  while(end && name[end-1] != ')') {
+    const char c = name[end-1];
+    if(!std::isalpha(static_cast<unsigned char>(c)) && c != ' ' && c != '&')
+      return len;
+    --end;
+  }
+  int depth = 0;
+  for( size_t i = end ; i-- > 0 ; ) {
+    if(name[i] == ')') {
+      ++depth;
+    } else if(name[i] == '(' && --depth == 0) {
+      return i;
+    }
+  }
+  return len;
+}
+
+bool starts_with( const char* name , size_t len , const std::string& prefix ) {
+  return len >= prefix.size() &&
+    memcmp(name,prefix.data(),prefix.size()) == 0;
+}
+} // namespace
+
+struct name_index::name_less_than {
+  const std::string* names;
+
+  explicit name_less_than( const std::string* n ):
+    names(n)
+  {}
+
+  int compare( const entry& e , const char* str , size_t len ) const {
+    const int ret = memcmp(names->data() + e.offset,str,
+        std::min<size_t>(e.length,len));
+    if(ret) return ret;
+    return e.length < len ? -1 : (e.length > len ? 1 : 0);
+  }
+
+  bool operator () ( const entry& l , const entry& r ) const {
+    return compare(l,names->data() + r.offset,r.length) < 0;
+  }
+
+  bool operator () ( const entry& l , const std::string& r ) const {
+    return compare(l,r.data(),r.size()) < 0;
+  }
+};
+
+// A compiled pattern with what the prefilter can use
+struct name_index::pattern {
+  bool regex;
+  std::string text;
+  std::string prefix;  // Every match starts with it
+  std::string literal; // Every match contains it
+  bool params;         // Match the whole name with the parameter list
+  regex_t compiled;
+
+  pattern():
+    regex(false),
+    text(),
+    prefix(),
+    literal(),
+    params(false)
+  {}
+
+  ~pattern() {
+    if(regex) regfree(&compiled);
+  }
+
+  bool init( const std::string& str );
+
+  // Whether the name passes the prefilter and then the pattern itself
+  bool matches( const char* name , size_t len , size_t function_len ) const;
+
+ private:
+  void add_run( const std::string& run , bool first ) {
+    if(first) prefix = run;
+    if(run.size() > literal.size()) literal = run;
+  }
+};
+
+bool name_index::pattern::init( const std::string& str ) {
+  if(str.size() > 2 && str[0] == '/' && str[str.size()-1] == '/') {
+    text = str.substr(1,str.size()-2);
+    // A bare "(" is a group , only an escaped one is part of the name
+    params = text.find("\\(") != std::string::npos;
+    if(regcomp(&compiled,text.c_str(),REG_EXTENDED|REG_NOSUB)) {
+      LOG(ERROR)<<"Cannot compile regular expression:"<<text<<"!";
+      return false;
+    }
+    regex = true;
+
+    // An alternation may not need any of the literals
+    if(text.find('|') != std::string::npos) return true;
+
+    const bool anchored = !text.empty() && text[0] == '^';
+    std::string run;
+    bool first = anchored;
+    for( size_t i = anchored ? 1 : 0 ; i < text.size() ; ++i ) {
+      const char c = text[i];
+      if(c == '*' || c == '?' || c == '{') {
+        // The character before is optional
+        if(!run.empty()) run.erase(run.size()-1);
+        if(c == '{') {
+          // The bounds of {m,n} are not part of the name
+          const size_t end = text.find('}',i+1);
+          if(end == std::string::npos) return true;
+          i = end;
+        }
+      } else if(!strchr(".[]()+}^$\\",c)) {
+        run.push_back(c);
+        continue;
+      }
+      add_run(run,first);
+      run.clear();
+      first = false;
+      // Nothing after a group or a bracket is known to follow the run
+      if(c == '(' || c == '[' || c == '\\') return true;
+    }
+    add_run(run,first);
+    return true;
+  }
+
+  text = str;
+  params = text.find('(') != std::string::npos;
+  std::string run;
+  bool first = true;
+  for( size_t i = 0 ; i < text.size() ; ++i ) {
+    const char c = text[i];
+    if(c == '\\' && i + 1 < text.size()) {
+      run.push_back(text[++i]);
+      continue;
+    }
+    if(!strchr("*?[",c)) {
+      run.push_back(c);
+      continue;
+    }
+    add_run(run,first);
+    run.clear();
+    first = false;
+    if(c == '[') {
+      // Skip the bracket expression , "]" right after "[" is a member
+      const size_t end = text.find(']',i+2);
+      if(end == std::string::npos) break;
+      i = end;
+    }
+  }
+  add_run(run,first);
+  return true;
+}
+
+bool name_index::pattern::matches( const char* name , size_t len ,
+    size_t function_len ) const {
+  if(!prefix.empty() && !starts_with(name,len,prefix)) return false;
+  if(prefix.empty() && literal.size() >= 3 &&
+     !memmem(name,len,literal.data(),literal.size()))
+    return false;
+  const std::string str(name,params ? len : function_len);
+  return regex ? regexec(&compiled,str.c_str(),0,NULL,0) == 0 :
+    fnmatch(text.c_str(),str.c_str(),0) == 0;
+}
+
+bool name_index::is_pattern( const std::string& target ) {
+  const std::string::size_type pos = target.find('!');
+  const std::string name = pos == std::string::npos ? target :
+    target.substr(pos+1);
+  if(name.size() > 2 && name[0] == '/' && name[name.size()-1] == '/')
+    return true;
+  return name.find_first_of("*?[") != std::string::npos;
+}
+
+void name_index::push( const symbol_table* table , size_t index ) {
+  entry e;
+  e.offset = static_cast<uint32_t>(m_names.size());
+  e.index = static_cast<uint32_t>(index);
+  e.table = table;
+
+  const std::string name = table->name(index);
+  char* demangled = NULL;
+  int status = -1;
+  if(name.size() > 2 && name.compare(0,2,"_Z") == 0)
+    demangled = abi::__cxa_demangle(name.c_str(),NULL,NULL,&status);
+  if(demangled && status == 0) {
+    m_names.append(demangled);
+  } else {
+    // A C symbol is its own demangled name
+    m_names.append(name);
+  }
+  free(demangled);
+
+  e.length = static_cast<uint32_t>(m_names.size() - e.offset);
+  e.function_length = static_cast<uint32_t>(
+      function_length(m_names.data() + e.offset,e.length));
+  m_names.push_back('\0');
+  m_entries.push_back(e);
+}
+
+void name_index::build() {
+  std::sort(m_entries.begin(),m_entries.end(),name_less_than(&m_names));
+
+  // Lay the arena out in the sorted order , so an offset hit by memmem is
+  // turned into its entry by binary search
+  std::string names;
+  names.reserve(m_names.size());
+  for( std::vector<entry>::iterator itr = m_entries.begin() ;
+      itr != m_entries.end() ; ++itr ) {
+    const uint32_t offset = static_cast<uint32_t>(names.size());
+    names.append(m_names,itr->offset,itr->length);
+    names.push_back('\0');
+    itr->offset = offset;
+  }
+  m_names.swap(names);
+}
+
+size_t name_index::entry_at( size_t offset ) const {
+  size_t low = 0 , high = m_entries.size();
+  while(high - low > 1) {
+    const size_t mid = (low + high) / 2;
+    if(m_entries[mid].offset <= offset) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+void name_index::candidates( const pattern& p ,
+    std::vector<size_t>* output ) const {
+  if(!p.prefix.empty()) {
+    std::vector<entry>::const_iterator itr = std::lower_bound(
+        m_entries.begin(),m_entries.end(),p.prefix,name_less_than(&m_names));
+    for( ; itr != m_entries.end() &&
+        starts_with(m_names.data() + itr->offset,itr->length,p.prefix) ;
+        ++itr ) {
+      output->push_back(itr - m_entries.begin());
+    }
+    return;
+  }
+
+  if(p.literal.size() >= 3) {
+    const char* start = m_names.data();
+    const char* end = start + m_names.size();
+    const char* pos = start;
+    while(pos < end) {
+      const void* hit = memmem(pos,end-pos,p.literal.data(),p.literal.size());
+      if(!hit) break;
+      const size_t index = entry_at(static_cast<const char*>(hit) - start);
+      output->push_back(index);
+      // Continue after the name that is hit
+      const entry& e = m_entries[index];
+      pos = start + e.offset + e.length + 1;
+    }
+    return;
+  }
+
+  for( size_t i = 0 ; i < m_entries.size() ; ++i ) output->push_back(i);
+}
+
+bool name_index::match( const std::string& str , const module_info* module ,
+    std::vector<const symbol_info*>* output ) const {
+  pattern p;
+  if(!p.init(str)) return false;
+
+  std::vector<size_t> list;
+  candidates(p,&list);
+  LOG(INFO)<<"Pattern:"<<str<<" has "<<list.size()<<" candidates out of "
+    <<m_entries.size()<<" names!";
+
+  BOOST_FOREACH(size_t index, list) {
+    const entry& e = m_entries[index];
+    if(module && e.table->module() != module) continue;
+    const std::string name(m_names,e.offset,
+        p.params ? e.length : e.function_length);
+    const bool matched = p.regex ?
+      regexec(&p.compiled,name.c_str(),0,NULL,0) == 0 :
+      fnmatch(p.text.c_str(),name.c_str(),0) == 0;
+    if(matched) output->push_back(e.table->symbol(e.index));
+  }
+  return true;
+}
+
+bool name_index::matches( const std::string& str , const std::string& name ) {
+  pattern p;
+  if(!p.init(str)) return false;
+  return p.matches(name.data(),name.size(),
+      function_length(name.data(),name.size()));
+}
+
+} // namespace dynhook
@@ -0,0 +1,82 @@
+#ifndef NAME_INDEX_H_
+#define NAME_INDEX_H_
+#include "process_info.h"
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <inttypes.h>
+#include <boost/noncopyable.hpp>
+
+namespace dynhook {
+class symbol_table;
+
+// Demangled names of the function symbols , used to match the pattern
+// targets of --hook. A pattern is either a glob , like MyServer::Handle* ,
+// or an extended regular expression between slashes , like /Codec::dec/.
+// A pattern without "(" ( "\(" for a regular expression ) is matched
+// against the name without its parameter list , so *Codec::decode matches
+// "JsonCodec::decode(Buffer&)".
+//
+// The names are sorted and kept in one contiguous arena. Only a few names
+// are ever handed to fnmatch/regexec : a pattern with a literal prefix
+// takes the range of names with that prefix by binary search , otherwise
+// the longest literal of the pattern is searched over the arena with
+// memmem and only the names it hits are matched.
+class name_index : private boost::noncopyable {
+ public:
+  typedef process_info::symbol_info symbol_info;
+  typedef process_info::module_info module_info;
+
+  name_index():
+    m_names(),
+    m_entries()
+  {}
+
+  // Whether the target of --hook is a pattern instead of a symbol name
+  static bool is_pattern( const std::string& target );
+
+  // Add the symbol at the index of the table
+  void push( const symbol_table* table , size_t index );
+
+  // Sort the names , no push after this
+  void build();
+
+  // Symbols whose name matches the pattern , only the symbols of module if
+  // it is not NULL. False if the pattern is broken.
+  bool match( const std::string& pattern , const module_info* module ,
+      std::vector<const symbol_info*>* output ) const;
+
+  // Whether one demangled name matches the pattern , through the same
+  // prefilter as match
+  static bool matches( const std::string& pattern , const std::string& name );
+
+  size_t size() const {
+    return m_entries.size();
+  }
+
+ private:
+  struct entry {
+    uint32_t offset;          // Where the name is in the arena
+    uint32_t length;
+    uint32_t function_length; // Length without the parameter list
+    uint32_t index;           // Index of the symbol in the table
+    const symbol_table* table;
+  };
+
+  struct name_less_than;
+  struct pattern;
+
+  // Entry whose name covers the arena offset
+  size_t entry_at( size_t offset ) const;
+
+  void candidates( const pattern& , std::vector<size_t>* output ) const;
+
+ private:
+  // Names separated by '\0' , in the order of m_entries after build
+  std::string m_names;
+  std::vector<entry> m_entries;
+};
+
+} // namespace dynhook
+#endif // NAME_INDEX_H_
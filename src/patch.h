@@ -1,6 +1,7 @@
 #ifndef PATCH_H_
 #define PATCH_H_
 #include "process_info.h"
+#include "function_analysis.h"
 
 #include <boost/scoped_array.hpp>
 #include <boost/noncopyable.hpp>
@@ -8,12 +9,13 @@
 #include <iostream>
 #include <inttypes.h>
 #include <set>
-
-#include "../instr/insn.h"
+#include <vector>
+#include <sys/user.h>
 
 namespace dynhook {
 class remote_allocator;
 class patch_manager;
+class live_patcher;
 
 // Patch. A patch class represents one patch towards the functions.
 // A patch is created through patch manager who includes all the
@@ -32,6 +34,8 @@ class patch {
     m_new_func(new_func_addr),
     m_func_code(),
     m_patched_entry(0),
+    m_detour_len(0),
+    m_analysis(),
     m_trampoline_code(),
     m_trampoline_code_size(0),
     m_detour_buffer(),
@@ -39,6 +43,7 @@ class patch {
     m_detour_buffer_addr(0),
     m_alloc(alloc),
     m_body_modified(false),
+    m_hook_size(0),
     m_checked(false)
   {}
 
@@ -49,9 +54,43 @@ class patch {
   // Used to check whether the patch can be performed or not
   bool check();
 
-  // Function that actually does the patch operation
+  // Function that actually does the patch operation. It is prepare
+  // followed by install.
   bool perform( uintptr_t* patched_entry );
 
+  // Generate the hook code and write the detour buffer into the remote
+  // process. The target function is not touched yet.
+  bool prepare( uintptr_t* patched_entry );
+
+  // Overwrite the head of the target function with the hook code. All
+  // the threads must be stopped , see live_patcher for a version that
+  // works with a running process.
+  bool install();
+
+  // Write the original bytes back. All the threads must be stopped and out
+  // of the hook code. It is done automatically when the patch is deleted.
+  bool uninstall();
+
+  // Where a thread that reaches the first byte of the target function
+  // ends up once the hook is installed
+  virtual uintptr_t hook_destination() const = 0;
+
+  // Move a thread out of the bytes that is going to be overwritten. The
+  // regs is updated and true is returned if the thread needs to be moved.
+  virtual bool move_thread( struct user_regs_struct* regs ) const;
+
+  // Whether the pc is inside of the bytes the hook code may overwrite. A
+  // thread parked there cannot resume once the hook is installed.
+  bool covers( uintptr_t pc ) const {
+    const size_t size = m_body_modified ? m_hook_size :
+      (m_patched_entry ? hook_code_size() : max_hook_size());
+    return pc > m_target.base && pc < m_target.base + size;
+  }
+
+  uintptr_t patched_entry() const {
+    return m_patched_entry;
+  }
+
   const process_info& proc() const {
     return m_pinfo;
   }
@@ -83,55 +122,19 @@ class patch {
   bool can_patch( size_t patch_size );
   int copy_detour( void* buffer , size_t hook_size , uintptr_t dest_addr );
   bool write_hook();
-  bool write_ool( uintptr_t where , const void* , size_t len );
  private:
   int copy_instruction( const void* src , void* dest,
       uintptr_t src_addr,
       uintptr_t dest_addr );
 
-  bool insn_is_indirect_jmp(const struct insn& insn) {
-    return ((insn.opcode.bytes[0] == 0xff &&
-             (X86_MODRM_REG(insn.modrm.value) & 6) == 4) ||
-             insn.opcode.bytes[0] == 0xea);
-  }
-
-  bool insn_is_jmp_instruction(const struct insn& insn) {
-    switch(insn.opcode.bytes[0]) {
-      case 0xe0: /* loopne */
-      case 0xe1: /* loope */
-      case 0xe2: /* loop */
-      case 0xe3: /* jcxz */
-      case 0xe9: /* near relative jump */
-      case 0xeb: /* short relative jump */
-        return true;
-      case 0x0f:
-        if((insn.opcode.bytes[1] &0xf0) == 0x80)
-          return true;
-        return false;
-      default:
-        if((insn.opcode.bytes[0] &0xf0) == 0x70)
-          return true;
-        return false;
-    }
-  }
-
-  bool insn_jump_into_range(const struct insn& insn,
-      uintptr_t start, uintptr_t end ) {
-    uintptr_t target = 0;
-    if(!insn_is_jmp_instruction(insn)) return false;
-    target = reinterpret_cast<uintptr_t>(insn.next_byte)
-      + insn.immediate.value;
-    return (start<=target && target<=end);
-  }
-
-  bool write_remote( uintptr_t , const char* , size_t len );
-
  protected:
   const process_info& m_pinfo; // Process information
   const process_info::symbol_info& m_target; // Which function to hooked
   uintptr_t m_new_func; // Which function is used to replace the target
   boost::scoped_array<char> m_func_code; // Function body's code
   uintptr_t m_patched_entry; // Where the function gets patched
+  size_t m_detour_len; // Length of the relocated instructions
+  function_analysis m_analysis; // Analysis of the function body
 
   // Currently our trampoline code is always the same , an absolute jump
   // with push/ret pair which saves us from using registers
@@ -148,11 +151,13 @@ class patch {
 
   // For recovery
   bool m_body_modified;
+  size_t m_hook_size; // How many bytes of the body is overwritten
 
   // For whether the target function is checked or not
   bool m_checked;
 
   friend class patch_manager;
+  friend class live_patcher;
 };
 
 class patch_manager : private boost::noncopyable {
@@ -167,14 +172,32 @@ class patch_manager : private boost::noncopyable {
       const std::string& hooked_function,
       uintptr_t new_func );
 
+  // Same as above for a symbol that is already found , for example one of
+  // the matches of a pattern target
+  patch* create_patch( remote_allocator* alloc ,
+      const process_info& pinfo ,
+      const process_info::symbol_info& target ,
+      uintptr_t new_func );
+
   size_t size() const {
     return m_patch_list.size();
   }
 
  private:
-  std::set<std::string> m_patch_list;
+  // Address of the patched functions , an alias of a patched function is
+  // the same function
+  std::set<uintptr_t> m_patch_list;
   friend class patch;
 };
 
+// Make sure no stopped thread sits inside of the bytes the patches are
+// going to overwrite. The registers of all the threads are read in one
+// pass , a thread parked inside of a prologue is moved to the relocated
+// copy in the detour buffer ; if it cannot be moved it is single stepped
+// until it leaves. It works in both directions : before the hook code is
+// installed and before the original bytes are recovered.
+bool relocate_threads( process_info* pinfo ,
+    const std::vector<patch*>& patches );
+
 } // namespace dynhook
 #endif // PATCH_H_
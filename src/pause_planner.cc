@@ -0,0 +1,88 @@
+#include "pause_planner.h"
+#include "patch.h"
+
+#include <algorithm>
+#include <glog/logging.h>
+
+namespace dynhook {
+
+bool pause_planner::begin() {
+  // Keep the thread that runs our stub code stopped , it is picked while
+  // every thread is still stopped
+  const pid_t tid = m_pinfo->invoke_thread();
+  if(!m_pinfo->resume_all()) return false;
+  return m_pinfo->stop_thread(tid ? tid : m_pinfo->pid());
+}
+
+void pause_planner::record( uint64_t pause ) {
+  size_t bucket = 0;
+  while((pause >> (bucket+1)) != 0) ++bucket;
+  if(m_histogram.size() <= bucket) m_histogram.resize(bucket+1,0);
+  ++m_histogram[bucket];
+  ++m_windows;
+  m_total += pause;
+  m_longest = std::max(m_longest,pause);
+  if(pause > m_budget) {
+    LOG(WARNING)<<"Stop window takes "<<pause<<" us which is over the "
+      "budget:"<<m_budget<<" us!";
+  }
+}
+
+bool pause_planner::window( const std::vector<patch*>& patches ,
+    size_t begin , size_t end , bool install ) {
+  const uint64_t start = base::monotonic_us();
+  if(!m_pinfo->stop_all()) return false;
+
+  std::vector<patch*> batch(patches.begin()+begin,patches.begin()+end);
+  if(!relocate_threads(m_pinfo,batch)) return false;
+  for( size_t i = 0 ; i < batch.size() ; ++i ) {
+    if(!(install ? batch[i]->install() : batch[i]->uninstall()))
+      return false;
+  }
+
+  // Flush the hooks and resume
+  if(!m_pinfo->resume_all()) return false;
+  record(base::monotonic_us() - start);
+  return true;
+}
+
+bool pause_planner::run( const std::vector<patch*>& patches ,
+    bool install ) {
+  size_t pos = 0;
+  size_t batch = 1;
+  while(pos < patches.size()) {
+    const size_t end = std::min(patches.size(),pos+batch);
+    const uint64_t start = base::monotonic_us();
+    if(!window(patches,pos,end,install)) return false;
+
+    // Size the next window with the cost per patch of this window. The
+    // cost includes the fixed cost of stopping the world , so we err on
+    // the short side.
+    const uint64_t cost = std::max<uint64_t>(1,
+        (base::monotonic_us() - start) / (end - pos));
+    batch = std::max<uint64_t>(1,m_budget / cost);
+    pos = end;
+    if(!poll()) return false;
+  }
+  return true;
+}
+
+bool pause_planner::install( const std::vector<patch*>& patches ) {
+  return run(patches,true);
+}
+
+bool pause_planner::uninstall( const std::vector<patch*>& patches ) {
+  return run(patches,false);
+}
+
+void pause_planner::dump( std::ostream& output ) const {
+  output<<"Stop windows:"<<m_windows<<" budget:"<<m_budget<<" us total:"
+    <<m_total<<" us longest:"<<m_longest<<" us\n";
+  for( size_t i = 0 ; i < m_histogram.size() ; ++i ) {
+    if(m_histogram[i] == 0) continue;
+    output<<"["<<(static_cast<uint64_t>(1)<<i)<<","
+      <<(static_cast<uint64_t>(1)<<(i+1))<<") us:"<<m_histogram[i]<<"\n";
+  }
+}
+
+} // namespace dynhook
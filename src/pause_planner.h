@@ -0,0 +1,77 @@
+#ifndef PAUSE_PLANNER_H_
+#define PAUSE_PLANNER_H_
+#include "process_info.h"
+
+#include <vector>
+#include <iostream>
+#include <inttypes.h>
+#include <boost/noncopyable.hpp>
+
+namespace dynhook {
+class patch;
+
+// Keep the target process running as much as possible while we patch it.
+//
+// All the tracer side work ( stub code generation , symbol lookup , body
+// analysis , detour relocation and remote allocation ) happens while the
+// target process is running. Only the thread picked by invoke_thread is
+// kept stopped since it runs our stub code ( the leader if none is picked ).
+// The scratch area of the stubs must be mapped before begin , while every
+// thread is still stopped. Then the prepared patches are installed in a few
+// stop windows : each window stops every thread , moves the threads out of
+// the prologues , writes a batch of hooks and resumes the process. The size
+// of the batch is picked from the cost of the previous window so that each
+// window fits into the pause budget.
+class pause_planner : private boost::noncopyable {
+ public:
+  pause_planner( process_info* pinfo , uint64_t budget ):
+    m_pinfo(pinfo),
+    m_budget(budget),
+    m_histogram(),
+    m_windows(0),
+    m_total(0),
+    m_longest(0)
+  {}
+
+  // Resume every thread except the one invoke_thread picks , which keeps
+  // running our stub code
+  bool begin();
+
+  // Let the running threads get their signals while we are busy preparing
+  bool poll() {
+    return m_pinfo->service_traps(0);
+  }
+
+  // Install prepared patches , the process is running after this call
+  bool install( const std::vector<patch*>& patches );
+
+  // Recover installed patches , the process is running after this call
+  bool uninstall( const std::vector<patch*>& patches );
+
+  // Dump the histogram of the pause length
+  void dump( std::ostream& output ) const;
+
+ private:
+  bool run( const std::vector<patch*>& patches , bool install );
+
+  // One stop window for patches in [begin,end)
+  bool window( const std::vector<patch*>& patches , size_t begin ,
+      size_t end , bool install );
+
+  void record( uint64_t pause );
+
+ private:
+  process_info* m_pinfo;
+
+  // Maximum length of one stop window in micro seconds
+  uint64_t m_budget;
+
+  // Bucket i counts the pauses within [2^i,2^(i+1)) micro seconds
+  std::vector<size_t> m_histogram;
+  size_t m_windows;
+  uint64_t m_total;
+  uint64_t m_longest;
+};
+
+} // namespace dynhook
+#endif // PAUSE_PLANNER_H_
@@ -1,8 +1,14 @@
 #include "process_info.h"
 #include "ptrace_util.h"
+#include "remote_memory.h"
+#include "elf_image.h"
+#include "symbol_table.h"
+#include "gnu_hash.h"
+#include "symbol_cache.h"
+#include "name_index.h"
+#include "frame_index.h"
 
 #include <errno.h>
-#include <fstream>
 #include <iostream>
 #include <iomanip>
 
@@ -11,14 +17,19 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <dirent.h>
+#include <link.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <cstdlib>
 
 #include <glog/logging.h>
 
 #include <boost/format.hpp>
-#include <boost/lexical_cast.hpp>
 #include <boost/foreach.hpp>
-#include <boost/algorithm/string.hpp>
-#include <boost/filesystem.hpp>
 
 #include <libelf.h> // For handling ELF files
 
@@ -26,90 +37,606 @@ namespace dynhook {
 
 
 namespace {
-uintptr_t address_cast( const std::string& src ) {
-  std::stringstream formatter;
-  formatter<<std::hex<<src;
-  uintptr_t ret;
-  formatter >> ret;
-  return ret;
+struct module_start_less_than {
+  bool operator () ( const process_info::module_info* l ,
+      const process_info::module_info* r ) const {
+    return l->start < r->start;
+  }
+};
+
+// Guard against a corrupted or cyclic link_map list
+const size_t kMaxLinkMap = 65536;
+
+const char kDeleted[] = " (deleted)";
+
+uintptr_t page_down( uintptr_t address ) {
+  static const uintptr_t page = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+  return address & ~(page - 1);
 }
-} // namespace
 
-bool process_info::parse_process_module_line( const std::string& line,
-    module_info* output ) {
-  std::vector<std::string> words;
-  boost::split(words,line,
-      boost::is_any_of(" "),boost::token_compress_on);
-  if(!words.empty()) {
-    // Check the permision is executable or not
-    if(words.size() >1 && words[1].find("x") != std::string::npos) {
-      // Parse the start-end
-      const std::string& range = words[0];
-      std::string::size_type pos = range.find_first_of("-");
-      if(pos == std::string::npos) {
-        goto fail;
-      } else {
-        output->start = address_cast(range.substr(0,pos));
-        output->end = address_cast(range.substr(pos+1,range.size()-pos-1));
-      }
-      // Parse the module path information
-      const std::string& path = words[words.size()-1];
-      if(is_abs_path(path)) {
-        output->path = path;
-        return true;
-      }
+uintptr_t page_up( uintptr_t address ) {
+  return page_down(address + static_cast<uintptr_t>(
+        ::sysconf(_SC_PAGESIZE)) - 1);
+}
+
+// Parse a hex number and move the cursor past it
+uintptr_t parse_hex( const char** cursor , const char* end ) {
+  uintptr_t ret = 0;
+  const char* p = *cursor;
+  for( ; p != end ; ++p ) {
+    const char c = *p;
+    if(c >= '0' && c <= '9') {
+      ret = (ret << 4) | (c - '0');
+    } else if(c >= 'a' && c <= 'f') {
+      ret = (ret << 4) | (c - 'a' + 10);
+    } else {
+      break;
     }
   }
-fail:
-  LOG(INFO)<<"cannot process line:"<<line<<" in maps file!";
-  return false;
+  *cursor = p;
+  return ret;
 }
 
-bool process_info::load_process_so_list( pid_t pid ) {
+const char* skip_spaces( const char* p , const char* end ) {
+  while(p != end && *p == ' ') ++p;
+  return p;
+}
+
+const char* skip_field( const char* p , const char* end ) {
+  while(p != end && *p != ' ') ++p;
+  return p;
+}
+
+// Path of the executable , what the link_map leaves empty
+std::string executable_path( pid_t pid ) {
+  const std::string link = (boost::format("/proc/%d/exe")%pid).str();
+  char buffer[PATH_MAX];
+  const ssize_t len = ::readlink(link.c_str(),buffer,sizeof(buffer)-1);
+  if(len <= 0) return std::string();
+  std::string ret(buffer,len);
+  const size_t deleted = sizeof(kDeleted) - 1;
+  if(ret.size() > deleted &&
+     ret.compare(ret.size()-deleted,deleted,kDeleted) == 0)
+    ret.erase(ret.size()-deleted);
+  return ret;
+}
+} // namespace
+
+bool process_info::parse_process_module_line( const char* line ,
+    const char* end , module_info* output , bool* executable ) const {
+  // start-end perms offset dev inode path
+  const char* p = line;
+  output->start = parse_hex(&p,end);
+  if(p == end || *p != '-') return false;
+  ++p;
+  output->end = parse_hex(&p,end);
+
+  // Check the permision is executable or not
+  p = skip_spaces(p,end);
+  const char* perms = p;
+  p = skip_field(p,end);
+  if(p - perms < 4) return false;
+  const bool x = perms[2] == 'x';
+
+  p = skip_spaces(p,end);
+  output->offset = parse_hex(&p,end);
+  p = skip_field(skip_spaces(p,end),end); // dev
+  p = skip_field(skip_spaces(p,end),end); // inode
+  p = skip_spaces(p,end);
+
+  // Anonymous mappings and [vdso] are not modules. A file that is removed
+  // after it is mapped is still there through /proc/<pid>/map_files
+  if(p == end || *p != '/') return false;
+  const size_t deleted = sizeof(kDeleted) - 1;
+  if(static_cast<size_t>(end - p) > deleted &&
+     memcmp(end - deleted,kDeleted,deleted) == 0)
+    end -= deleted;
+  output->path.assign(p,end);
+  *executable = x;
+  return true;
+}
+
+bool process_info::add_module( const module_info& minfo ) {
+  std::pair<module_list::iterator,bool> ret = m_modules.insert(minfo);
+  if(!ret.second) return false;
+  m_load_order.push_back(&*ret.first);
+  return true;
+}
+
+bool process_info::load_file_mappings( pid_t pid ,
+    file_mapping_list* output ) const {
   std::string path = (boost::format("/proc/%d/maps")%pid).str();
-  std::fstream file(path.c_str(),std::ios::in);
-  if(!file) {
+  base::scoped_fd fd( ::open(path.c_str(),O_RDONLY) );
+  if(!fd) {
     LOG(ERROR)<<"Cannot open file:"
       <<path<<" with error :"<<std::strerror(errno);
     return false;
   }
 
-  // Now we start to parse the process/maps file
-  std::string line;
-
-  while( std::getline(file,line) ) {
-    if(!line.empty()) {
-      module_info minfo;
-      if(parse_process_module_line(line,&minfo)) {
-        m_modules.insert(minfo);
-        // Assume very first line is the path of the executable
-        if(m_entry_info.path.empty()) {
-          m_entry_info = minfo;
-        }
-      }
+  // Read the whole file in large chunks , the lines are parsed in place
+  std::vector<char> buffer(1<<16);
+  size_t size = 0;
+  for( ;; ) {
+    if(size == buffer.size()) buffer.resize(buffer.size()*2);
+    const ssize_t ret = ::read(fd.fd(),&buffer[size],buffer.size()-size);
+    if(ret < 0) {
+      if(errno == EINTR) continue;
+      LOG(ERROR)<<"Cannot read file:"<<path<<" with error :"
+        <<std::strerror(errno);
+      return false;
     }
+    if(ret == 0) break;
+    size += static_cast<size_t>(ret);
   }
 
+  const char* line = size ? &buffer[0] : NULL;
+  const char* end = line + size;
+  file_mapping mapping;
+  while(line < end) {
+    const char* eol = static_cast<const char*>(memchr(line,'\n',end-line));
+    if(!eol) eol = end;
+    if(parse_process_module_line(line,eol,&mapping.range,
+          &mapping.executable))
+      output->push_back(mapping);
+    line = eol + 1;
+  }
   return true;
 }
 
-bool process_info::load_symbol_info() {
-  BOOST_FOREACH(const module_info& minfo, m_modules) {
-    if(!load_symbol_info(minfo)) {
+const process_info::file_mapping* process_info::mapping_at(
+    const file_mapping_list& mappings , uintptr_t address ) {
+  BOOST_FOREACH(const file_mapping& mapping, mappings) {
+    if(address >= mapping.range.start && address < mapping.range.end)
+      return &mapping;
+  }
+  return NULL;
+}
+
+uintptr_t process_info::header_of( const file_mapping_list& mappings ,
+    const std::string& path ) {
+  BOOST_FOREACH(const file_mapping& mapping, mappings) {
+    if(mapping.range.offset == 0 && mapping.range.path == path)
+      return mapping.range.start;
+  }
+  return 0;
+}
+
+const process_info::file_mapping* process_info::code_of(
+    const file_mapping_list& mappings , const std::string& path ) {
+  BOOST_FOREACH(const file_mapping& mapping, mappings) {
+    if(mapping.executable && mapping.range.path == path) return &mapping;
+  }
+  return NULL;
+}
+
+bool process_info::load_process_so_list( pid_t pid ) {
+  file_mapping_list mappings;
+  if(!load_file_mappings(pid,&mappings)) return false;
+
+  const std::string exe = executable_path(pid);
+  BOOST_FOREACH(const file_mapping& mapping, mappings) {
+    if(!mapping.executable) continue;
+    module_info minfo = mapping.range;
+    minfo.header = header_of(mappings,minfo.path);
+    const bool is_entry = exe.empty() ? m_entry_info.path.empty() :
+      minfo.path == exe;
+    // Without the link_map the bias comes from the ELF header in memory
+    uint64_t dynamic;
+    if(!remote_dynamic_of(minfo,&minfo.bias,&dynamic))
+      minfo.bias = is_entry ? 0 : minfo.start - minfo.offset;
+    if(add_module(minfo) && is_entry) m_entry_info = minfo;
+  }
+  return !m_entry_info.path.empty();
+}
+
+bool process_info::read_remote_string( uintptr_t address ,
+    std::string* output ) const {
+  output->clear();
+  char buffer[64];
+  while(output->size() < PATH_MAX) {
+    // Don't read across the page , the next one may not be mapped
+    const size_t len = std::min<size_t>(sizeof(buffer),
+        page_down(address) + ::sysconf(_SC_PAGESIZE) - address);
+    if(!m_memory->read(address,buffer,len)) return false;
+    const char* nul = static_cast<const char*>(memchr(buffer,0,len));
+    if(nul) {
+      output->append(buffer,nul - buffer);
+      return true;
+    }
+    output->append(buffer,len);
+    address += len;
+  }
+  return false;
+}
+
+bool process_info::load_module_range( const Elf64_Phdr* phdrs ,
+    size_t count , module_info* output ) const {
+  for( size_t i = 0 ; i < count ; ++i ) {
+    const Elf64_Phdr& phdr = phdrs[i];
+    if(phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X)) continue;
+    const uintptr_t start = output->bias + phdr.p_vaddr;
+    output->start = page_down(start);
+    output->end = page_up(start + phdr.p_memsz);
+    output->offset = page_down(phdr.p_offset);
+    return true;
+  }
+  return false;
+}
+
+bool process_info::load_link_map() {
+  // 1. Program headers of the executable
+  const std::string auxv_path = (boost::format("/proc/%d/auxv")%m_pid).str();
+  base::scoped_fd fd( ::open(auxv_path.c_str(),O_RDONLY) );
+  if(!fd) return false;
+  uintptr_t phdr_address = 0 , phnum = 0;
+  Elf64_auxv_t auxv;
+  while(::read(fd.fd(),&auxv,sizeof(auxv)) == sizeof(auxv) &&
+        auxv.a_type != AT_NULL) {
+    if(auxv.a_type == AT_PHDR) phdr_address = auxv.a_un.a_val;
+    if(auxv.a_type == AT_PHNUM) phnum = auxv.a_un.a_val;
+  }
+  if(!phdr_address || !phnum) return false;
+
+  std::vector<Elf64_Phdr> phdrs(phnum);
+  if(!m_memory->read(phdr_address,&phdrs[0],phnum*sizeof(Elf64_Phdr)))
+    return false;
+
+  module_info entry;
+  bool has_phdr = false;
+  uint64_t dynamic = 0 , dynamic_size = 0;
+  BOOST_FOREACH(const Elf64_Phdr& phdr, phdrs) {
+    if(phdr.p_type == PT_PHDR) {
+      entry.bias = phdr_address - phdr.p_vaddr;
+      has_phdr = true;
+    } else if(phdr.p_type == PT_DYNAMIC) {
+      dynamic = phdr.p_vaddr;
+      dynamic_size = phdr.p_memsz;
+    }
+  }
+  // A static executable has neither of them
+  if(!has_phdr || !dynamic) return false;
+
+  // 2. r_debug from DT_DEBUG , filled by the dynamic linker
+  std::vector<Elf64_Dyn> dyns(dynamic_size / sizeof(Elf64_Dyn));
+  if(dyns.empty() || !m_memory->read(entry.bias + dynamic,&dyns[0],
+        dyns.size()*sizeof(Elf64_Dyn)))
+    return false;
+  uintptr_t debug = 0;
+  BOOST_FOREACH(const Elf64_Dyn& dyn, dyns) {
+    if(dyn.d_tag == DT_NULL) break;
+    if(dyn.d_tag == DT_DEBUG) debug = dyn.d_un.d_ptr;
+  }
+  struct r_debug rdebug;
+  if(!debug || !m_memory->read(debug,&rdebug,sizeof(rdebug)) ||
+     !rdebug.r_map)
+    return false;
+
+  // 3. The link_map list in load order , the executable comes first
+  entry.path = executable_path(m_pid);
+  entry.dynamic = dynamic;
+  if(entry.path.empty() ||
+     !load_module_range(&phdrs[0],phdrs.size(),&entry))
+    return false;
+
+  file_mapping_list mappings;
+  if(!load_file_mappings(m_pid,&mappings)) return false;
+  entry.header = header_of(mappings,entry.path);
+
+  size_t count = 0;
+  uintptr_t address = reinterpret_cast<uintptr_t>(rdebug.r_map);
+  for( ; address && count < kMaxLinkMap ; ++count ) {
+    struct link_map lm;
+    if(!m_memory->read(address,&lm,sizeof(lm))) {
+      LOG(WARNING)<<"Cannot read link_map entry at:"<<std::hex<<address
+        <<std::dec<<"!";
+      return false;
+    }
+    address = reinterpret_cast<uintptr_t>(lm.l_next);
+    if(count == 0) {
+      add_module(entry);
+      m_entry_info = entry;
+      continue;
+    }
+
+    std::string name;
+    if(!lm.l_name || !read_remote_string(
+          reinterpret_cast<uintptr_t>(lm.l_name),&name))
       return false;
+    // The vdso has no file
+    if(!is_abs_path(name)) continue;
+
+    // Nothing is read from our own file system , the path may name another
+    // file here when the process lives in a container. l_ld tells which
+    // file is really mapped , l_name may be a symbolic link of it.
+    module_info minfo;
+    minfo.bias = lm.l_addr;
+    minfo.path = name;
+    std::string file = name;
+    if(lm.l_ld) {
+      const uintptr_t ld = reinterpret_cast<uintptr_t>(lm.l_ld);
+      minfo.dynamic = ld - lm.l_addr;
+      const file_mapping* mapping = mapping_at(mappings,ld);
+      if(mapping) file = mapping->range.path;
+    }
+    minfo.header = header_of(mappings,file);
+
+    // l_addr is only the bias added to p_vaddr , a prelinked object at its
+    // preferred address has 0. The maps file has the code mapping of a
+    // module whose program headers cannot be read.
+    std::vector<Elf64_Phdr> module_phdrs;
+    if(!minfo.header ||
+       !remote_program_headers(minfo.header,name,&module_phdrs) ||
+       !load_module_range(&module_phdrs[0],module_phdrs.size(),&minfo)) {
+      const file_mapping* code = code_of(mappings,file);
+      if(!code) {
+        LOG(WARNING)<<"Module:"<<name<<" has no executable mapping!";
+        continue;
+      }
+      minfo.start = code->range.start;
+      minfo.end = code->range.end;
+      minfo.offset = code->range.offset;
+    }
+    add_module(minfo);
+  }
+  if(address) return false;
+
+  LOG(INFO)<<"Find "<<m_modules.size()<<" modules through link_map of "
+    <<count<<" entries!";
+  return !m_modules.empty();
+}
+
+process_info::load_job::load_job():
+  module(NULL),
+  image(NULL),
+  frames(NULL),
+  table(NULL),
+  cache(NULL),
+  elf(NULL),
+  names(NULL),
+  loader(NULL),
+  duration(0)
+{}
+
+process_info::load_job::~load_job() {
+  // Whatever is not handed over to process_info by finish_load
+  delete table;
+  delete cache;
+  delete names;
+  if(elf) elf_end(elf);
+}
+
+const symbol_table& process_info::symbols_of(
+    const module_info& minfo ) const {
+  symbol_table_map::const_iterator itr = m_symbol_tables.find(&minfo);
+  if(itr != m_symbol_tables.end()) return *itr->second;
+
+  load_job job;
+  prepare_load(minfo,&job);
+  run_load(&job);
+  m_load_duration += job.duration;
+  return finish_load(&job);
+}
+
+void process_info::prepare_load( const module_info& minfo ,
+    load_job* job ) const {
+  job->module = &minfo;
+  // Map the file here , image_of is not thread safe
+  job->image = image_of(minfo);
+  job->frames = frames_of(minfo);
+  job->table = new symbol_table();
+  job->loader = m_symbol_loader == MMAP_LOADER ? "mmap" : "libelf";
+
+  // Without the file read the dynamic symbols out of the process. It is
+  // done here since not every memory backend can be used by other threads.
+  if(!job->image) {
+    const uint64_t start = base::monotonic_us();
+    if(load_symbol_info_remote(job)) job->loader = "remote";
+    job->duration = base::monotonic_us() - start;
+  }
+}
+
+void process_info::run_load( load_job* job ) const {
+  const module_info& minfo = *job->module;
+  const uint64_t start = base::monotonic_us();
+
+  // Try the symbol cache first
+  std::string cache_key;
+  if(!m_symbol_cache_dir.empty() && job->image) {
+    cache_key = symbol_cache::key_of(*job->image,minfo.path == path());
+    if(!cache_key.empty())
+      job->cache = symbol_cache::open(m_symbol_cache_dir,cache_key);
+    if(job->cache) {
+      job->cache->fill(&minfo,module_offset(minfo),job->table);
+      job->loader = "cache";
+    }
+  }
+
+  bool write_cache = false;
+  if(job->table->size() == 0 && job->names == NULL) {
+    if(!load_symbol_info(job)) {
+      // Keep an empty table , there's no point to retry
+      LOG(WARNING)<<"Skip symbols of module:"<<minfo.path<<"!";
+      delete job->table;
+      job->table = new symbol_table();
+    } else {
+      write_cache = !cache_key.empty();
+    }
+    // Hand written assembly often has no st_size
+    const size_t sized = job->frames ?
+      job->table->size_from(*job->frames,module_offset(minfo)) : 0;
+    if(sized) {
+      LOG(INFO)<<"Size "<<sized<<" symbols of module:"<<minfo.path
+        <<" by .eh_frame_hdr!";
+    }
+  }
+  job->table->build();
+  if(write_cache) {
+    symbol_cache::write(m_symbol_cache_dir,cache_key,*job->table,
+        *job->image,module_offset(minfo));
+  }
+  job->duration += base::monotonic_us() - start;
+}
+
+const symbol_table& process_info::finish_load( load_job* job ) const {
+  const size_t count = job->table->size();
+  const size_t bytes = job->table->memory_usage();
+  LOG(INFO)<<"Load "<<count<<" symbols of module:"
+    <<job->module->path<<" with "<<job->loader<<" loader in "
+    <<job->duration<<" us , "<<bytes<<" bytes ( "
+    <<(count ? bytes / count : 0)<<" per symbol )!";
+
+  // The table has its own copy of the names , what they are read from is
+  // let go with the job
+  if(job->image) job->image->release_pages();
+
+  const symbol_table& ret = *job->table;
+  const module_info* key = job->module;
+  m_symbol_tables.insert(key,job->table);
+  job->table = NULL;
+  return ret;
+}
+
+// Jobs shared by the workers of load_all_symbols , each worker takes the
+// next job until there's none left
+struct process_info::load_queue {
+  const process_info* pinfo;
+  std::vector<load_job*> jobs;
+  volatile size_t next;
+};
+
+void* process_info::load_worker( void* arg ) {
+  load_queue* queue = static_cast<load_queue*>(arg);
+  for( ;; ) {
+    const size_t index = __sync_fetch_and_add(&queue->next,1);
+    if(index >= queue->jobs.size()) break;
+    queue->pinfo->run_load(queue->jobs[index]);
+  }
+  return NULL;
+}
+
+void process_info::load_all_symbols() const {
+  boost::ptr_vector<load_job> jobs;
+  BOOST_FOREACH(const module_info* minfo, m_load_order) {
+    if(m_symbol_tables.find(minfo) != m_symbol_tables.end()) continue;
+    jobs.push_back(new load_job());
+    prepare_load(*minfo,&jobs.back());
+  }
+  if(jobs.empty()) return;
+
+  const uint64_t start = base::monotonic_us();
+  // libelf is not thread safe unless it is built so , keep it on one thread
+  const size_t threads = m_symbol_loader == LIBELF_LOADER ? 1 :
+    std::min(m_symbol_threads,jobs.size());
+
+  load_queue queue;
+  queue.pinfo = this;
+  queue.next = 0;
+  BOOST_FOREACH(load_job& job, jobs) queue.jobs.push_back(&job);
+
+  // The calling thread is one of the workers
+  std::vector<pthread_t> workers;
+  for( size_t i = 1 ; i < threads ; ++i ) {
+    pthread_t tid;
+    if(pthread_create(&tid,NULL,load_worker,&queue)) {
+      LOG(WARNING)<<"Cannot create symbol loading thread , use "
+        <<workers.size()+1<<" threads!";
+      break;
+    }
+    workers.push_back(tid);
+  }
+  load_worker(&queue);
+  BOOST_FOREACH(pthread_t tid, workers) pthread_join(tid,NULL);
+
+  // Merge in load order , the duration counts the wall time only
+  BOOST_FOREACH(load_job& job, jobs) finish_load(&job);
+  const uint64_t duration = base::monotonic_us() - start;
+  m_load_duration += duration;
+  LOG(INFO)<<"Load symbols of "<<jobs.size()<<" modules with "
+    <<workers.size()+1<<" threads in "<<duration<<" us!";
+}
+
+int process_info::parse_symbol_loader( const std::string& name ) {
+  if(name == "mmap") return MMAP_LOADER;
+  if(name == "libelf") return LIBELF_LOADER;
+  return -1;
+}
+
+bool process_info::load_symbol_info( load_job* job ) const {
+  return m_symbol_loader == MMAP_LOADER ?
+    load_symbol_info_mmap(*job->module,job->image,job->table) :
+    load_symbol_info_libelf(*job->module,job->image,job->table,&job->elf);
+}
+
+namespace {
+// Functions and the resolvers of IFUNC functions like memcpy , the latter
+// are marked by is_ifunc
+bool is_function_symbol( const Elf64_Sym& sym ) {
+  // Skip none function type
+  // The STB_NUM really just means that the binding type
+  // has 3 different types. Here I do check simply because
+  // I saw some other guy did it. I don't really know why
+  // or is there any valid ELF will contain a st_info bits
+  // set to STB_NUM.
+  return sym.st_value != 0 &&
+    ELF64_ST_BIND(sym.st_info) != STB_NUM &&
+    (ELF64_ST_TYPE(sym.st_info) == STT_FUNC ||
+     ELF64_ST_TYPE(sym.st_info) == STT_GNU_IFUNC);
+}
+
+bool is_ifunc( const Elf64_Sym& sym ) {
+  return ELF64_ST_TYPE(sym.st_info) == STT_GNU_IFUNC;
+}
+} // namespace
+
+bool process_info::load_symbol_info_mmap(
+    const module_info& minfo , const elf_image* image ,
+    symbol_table* table ) const {
+  // Whether this module is the ELF loaded for execution
+  const bool is_entry = minfo.path == path();
+
+  const uintptr_t offset = module_offset(minfo);
+
+  if(!image) {
+    LOG(ERROR)<<"Cannot load module:"<<minfo.path;
+    return false;
+  }
+
+  // Same as the libelf loader : the executable uses both of its symbol
+  // tables , a shared object uses its dynamic symbol table only
+  const uint32_t types[] = { SHT_SYMTAB , SHT_DYNSYM };
+  for( size_t i = is_entry ? 0 : 1 ; i < 2 ; ++i ) {
+    const Elf64_Shdr* shdr = image->next_section(types[i]);
+    if(!shdr) continue;
+
+    size_t count;
+    const Elf64_Sym* sym = image->symbols(*shdr,&count);
+    if(!sym) return false;
+    for( const Elf64_Sym* end = sym + count ; sym != end ; ++sym ) {
+      if(!is_function_symbol(*sym)) continue;
+      // The name points into the mapped string table , no copy
+      table->push(symbol_info(sym->st_value + offset,
+            image->symbol_name(*shdr,*sym),
+            sym->st_size,
+            ELF64_ST_BIND(sym->st_info) == STB_WEAK,
+            &minfo,
+            NULL,
+            is_ifunc(*sym)));
     }
   }
   return true;
 }
 
-bool process_info::load_symbol_info(
-    const module_info& minfo ) {
+bool process_info::load_symbol_info_libelf(
+    const module_info& minfo , const elf_image* image ,
+    symbol_table* table , Elf** handle ) const {
   // Whether this module is the ELF loaded for execution
   const bool is_entry = minfo.path == path();
 
-  const uintptr_t offset = is_entry ? 0 : minfo.start;
+  const uintptr_t offset = module_offset(minfo);
 
-  base::scoped_fd fd( ::open(minfo.path.c_str(),O_RDONLY) );
+  // Open the same file as the mmap loader does
+  const std::string& file = image ? image->path() : minfo.path;
+  base::scoped_fd fd( ::open(file.c_str(),O_RDONLY) );
   if(!fd) {
     LOG(ERROR)<<"Cannot load module:"<<minfo.path<<" with error:"
       << std::strerror(errno);
@@ -168,17 +695,7 @@ bool process_info::load_symbol_info(
           static_cast<char*>(elf_data->d_buf) + elf_data->d_size);
 
       for( ; elf_sym != elf_end ; ++elf_sym ) {
-        if(elf_sym->st_value == 0 ||
-           (ELF64_ST_BIND(elf_sym->st_info) == STB_NUM) ||
-           (ELF64_ST_TYPE(elf_sym->st_info) != STT_FUNC)) {
-          // Skip none function type
-          // The STB_NUM really just means that the binding type
-          // has 3 different types. Here I do check simply because
-          // I saw some other guy did it. I don't really know why
-          // or is there any valid ELF will contain a st_info bits
-          // set to STB_NUM.
-          continue;
-        }
+        if(!is_function_symbol(*elf_sym)) continue;
         // We have a function symbol here
         symbol_info sinfo;
         sinfo.name = elf_strptr(elf,elf_shdr->sh_link,static_cast<size_t>(
@@ -186,168 +703,861 @@ bool process_info::load_symbol_info(
         sinfo.size = elf_sym->st_size;
         sinfo.weak = ELF64_ST_BIND(elf_sym->st_info) == STB_WEAK;
         sinfo.base = elf_sym->st_value + offset;
+        sinfo.module = &minfo;
+        sinfo.ifunc = is_ifunc(*elf_sym);
 
         // Push the symbol_info into our list
-        push_symbol_info(sinfo);
+        table->push(sinfo);
       }
     }
   } while(is_entry && cnt < 2);
 
-  LOG(INFO)<<"Load "<<m_symbol_info.size()<<" symbols!";
-
-  elf_end(elf);
+  // The names point into the string tables owned by the handle , keep it
+  // until the table is built and let it go of the file
+  elf_cntl(elf,ELF_C_FDDONE);
+  *handle = elf;
   return true;
 fail:
   elf_end(elf);
   return false;
 }
 
+bool process_info::remote_program_headers( uintptr_t header ,
+    const std::string& path , std::vector<Elf64_Phdr>* output ) const {
+  Elf64_Ehdr ehdr;
+  if(!m_memory->read(header,&ehdr,sizeof(ehdr)) ||
+     memcmp(ehdr.e_ident,ELFMAG,SELFMAG) != 0 ||
+     ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+     ehdr.e_phentsize != sizeof(Elf64_Phdr) || ehdr.e_phnum == 0) {
+    LOG(WARNING)<<"Cannot find ELF header of module:"<<path
+      <<" at:"<<std::hex<<header<<std::dec<<"!";
+    return false;
+  }
 
-bool process_info::init() {
-  if(!load_process_so_list(m_pid))
+  output->resize(ehdr.e_phnum);
+  return m_memory->read(header + ehdr.e_phoff,&(*output)[0],
+      output->size()*sizeof(Elf64_Phdr));
+}
+
+bool process_info::remote_dynamic_of( const module_info& minfo ,
+    uintptr_t* bias , uint64_t* dynamic ) const {
+  // The link_map already gave the exact bias
+  if(minfo.dynamic) {
+    *bias = minfo.bias;
+    *dynamic = minfo.dynamic;
+    return true;
+  }
+  // The mapping of file offset 0 holds the ELF header , which is not
+  // always start - offset : lld puts the code at a vaddr that differs from
+  // its file offset
+  if(!minfo.header) return false;
+  const uintptr_t header = minfo.header;
+  std::vector<Elf64_Phdr> phdrs;
+  if(!remote_program_headers(header,minfo.path,&phdrs)) return false;
+
+  bool found = false;
+  *dynamic = 0;
+  BOOST_FOREACH(const Elf64_Phdr& phdr, phdrs) {
+    if(phdr.p_type == PT_LOAD && phdr.p_offset == 0 && !found) {
+      *bias = header - phdr.p_vaddr;
+      found = true;
+    } else if(phdr.p_type == PT_DYNAMIC) {
+      *dynamic = phdr.p_vaddr;
+    }
+  }
+  return found && *dynamic != 0;
+}
+
+bool process_info::load_symbol_info_remote( load_job* job ) const {
+  const module_info& minfo = *job->module;
+  uintptr_t bias;
+  uint64_t dynamic;
+  if(!remote_dynamic_of(minfo,&bias,&dynamic)) return false;
+
+  // The hash table tells how large the dynamic symbol table is , then the
+  // symbols and the names are read in one go each
+  boost::scoped_ptr<gnu_hash_resolver> resolver( gnu_hash_resolver::create(
+        new remote_reader(m_memory.get(),bias),dynamic,bias) );
+  if(!resolver) {
+    LOG(WARNING)<<"Module:"<<minfo.path<<" doesn't have DT_GNU_HASH!";
     return false;
-  if(!load_symbol_info())
+  }
+  const size_t count = resolver->symbol_count();
+  if(count == 0 || resolver->strsz() == 0) return false;
+
+  std::vector<Elf64_Sym> symbols(count);
+  std::auto_ptr<std::string> names( new std::string(resolver->strsz(),0) );
+  if(!m_memory->read(bias + resolver->symtab(),&symbols[0],
+        count*sizeof(Elf64_Sym)) ||
+     !m_memory->read(bias + resolver->strtab(),&(*names)[0],names->size())) {
+    LOG(WARNING)<<"Cannot read dynamic symbols of module:"<<minfo.path<<"!";
     return false;
+  }
+
+  BOOST_FOREACH(const Elf64_Sym& sym, symbols) {
+    if(!is_function_symbol(sym) || sym.st_name >= names->size()) continue;
+    const char* name = names->data() + sym.st_name;
+    job->table->push(symbol_info(sym.st_value + bias,
+          base::string_ref(name,strnlen(name,names->size()-sym.st_name)),
+          sym.st_size,
+          ELF64_ST_BIND(sym.st_info) == STB_WEAK,
+          &minfo,
+          NULL,
+          is_ifunc(sym)));
+  }
+  job->names = names.release();
+  return true;
+}
+
+bool process_info::init() {
+  // Symbol tables are loaded lazily by find_symbol
+  if(!load_link_map()) {
+    LOG(INFO)<<"Cannot walk link_map of process:"<<m_pid
+      <<" , parse the maps file!";
+    m_modules.clear();
+    m_load_order.clear();
+    m_entry_info = module_info();
+    if(!load_process_so_list(m_pid))
+      return false;
+  }
+
+  m_address_order = m_load_order;
+  std::sort(m_address_order.begin(),m_address_order.end(),
+      module_start_less_than());
+  std::vector<uintptr_t> starts;
+  BOOST_FOREACH(const module_info* minfo, m_address_order)
+    starts.push_back(minfo->start);
+  m_module_index.build(starts);
   return true;
 }
 
+const process_info::module_info*
+process_info::find_module( const std::string& name ) const {
+  BOOST_FOREACH(const module_info* minfo, m_load_order) {
+    if(minfo->path == name) return minfo;
+    std::string::size_type pos = minfo->path.rfind('/');
+    const std::string file = minfo->path.substr(pos+1);
+    // libc.so matches libc.so.6 , libfoo matches libfoo.so
+    if(file.compare(0,name.size(),name) == 0 &&
+       (file.size() == name.size() || file[name.size()] == '.')) {
+      return minfo;
+    }
+  }
+  return NULL;
+}
+
+const elf_image* process_info::image_of( const module_info& minfo ) const {
+  boost::ptr_map<const module_info*,elf_image>::const_iterator itr =
+    m_images.find(&minfo);
+  if(itr != m_images.end()) return itr->second;
+  elf_image* image = elf_image::create(
+      (boost::format("/proc/%d/map_files/%lx-%lx") % m_pid % minfo.start %
+       minfo.end).str());
+  if(!image) image = elf_image::create(minfo.path);
+  if(!image) return NULL;
+  const module_info* key = &minfo;
+  m_images.insert(key,image);
+  return image;
+}
+
+const gnu_hash_resolver* process_info::resolver_of(
+    const module_info& minfo ) const {
+  resolver_map::const_iterator itr = m_resolvers.find(&minfo);
+  if(itr != m_resolvers.end()) return itr->second;
+
+  gnu_hash_resolver* resolver = NULL;
+  const elf_image* image = image_of(minfo);
+  uintptr_t bias;
+  uint64_t dynamic;
+  if(image) {
+    image_reader* reader = new image_reader(*image);
+    resolver = gnu_hash_resolver::create(reader,reader->dynamic());
+  } else if(remote_dynamic_of(minfo,&bias,&dynamic)) {
+    resolver = gnu_hash_resolver::create(
+        new remote_reader(m_memory.get(),bias),dynamic,bias);
+  }
+  const module_info* key = &minfo;
+  m_resolvers.insert(key,resolver);
+  return resolver;
+}
+
+const frame_index* process_info::frames_of(
+    const module_info& minfo ) const {
+  frame_index_map::const_iterator itr = m_frames.find(&minfo);
+  if(itr != m_frames.end()) return itr->second;
+
+  const elf_image* image = image_of(minfo);
+  frame_index* frames = image ? frame_index::create(*image) : NULL;
+  const module_info* key = &minfo;
+  m_frames.insert(key,frames);
+  return frames;
+}
+
+const process_info::symbol_info* process_info::frame_symbol(
+    const module_info& minfo , uintptr_t address ) const {
+  const frame_index* frames = frames_of(minfo);
+  uint64_t start , size;
+  const uintptr_t offset = module_offset(minfo);
+  if(!frames || !frames->find(address - offset,&start,&size)) return NULL;
+
+  uintptr_t base = start + offset;
+  boost::ptr_map<uintptr_t,frame_symbol_info>::iterator itr =
+    m_frame_symbols.find(base);
+  if(itr != m_frame_symbols.end()) return &itr->second->info;
+
+  std::auto_ptr<frame_symbol_info> sym( new frame_symbol_info() );
+  sym->name = (boost::format("0x%x")%base).str();
+  sym->info = symbol_info(base,sym->name,size,false,&minfo);
+  const symbol_info* ret = &sym->info;
+  m_frame_symbols.insert(base,sym.release());
+  return ret;
+}
+
+const process_info::symbol_info*
+process_info::find_dynamic_symbol( const std::string& name ) const {
+  std::map<std::string,symbol_info>::const_iterator itr =
+    m_dynamic_symbols.find(name);
+  if(itr != m_dynamic_symbols.end()) return &itr->second;
+
+  BOOST_FOREACH(const module_info* minfo, m_load_order) {
+    // Our stubs call what is found here , which must not be a resolver
+    const gnu_hash_resolver* resolver = resolver_of(*minfo);
+    if(!resolver) {
+      // No hash table , fall back to the symbol table , which only holds
+      // the function symbols ( see is_function_symbol )
+      const symbol_info* sinfo = symbols_of(*minfo).find(name);
+      if(sinfo && !sinfo->ifunc) return sinfo;
+      continue;
+    }
+    Elf64_Sym sym;
+    if(!resolver->lookup(name.c_str(),&sym) || !is_function_symbol(sym) ||
+       is_ifunc(sym))
+      continue;
+
+    std::map<std::string,symbol_info>::iterator ret =
+      m_dynamic_symbols.insert(std::make_pair(name,symbol_info())).first;
+    ret->second = symbol_info(sym.st_value + module_offset(*minfo),
+        ret->first,
+        sym.st_size,
+        ELF64_ST_BIND(sym.st_info) == STB_WEAK,
+        minfo);
+    return &ret->second;
+  }
+  return NULL;
+}
+
+const process_info::module_info*
+process_info::find_module( uintptr_t address ) const {
+  const size_t index = m_module_index.find(address);
+  if(index == address_index::npos) return NULL;
+  const module_info* minfo = m_address_order[index];
+  return address < minfo->end ? minfo : NULL;
+}
+
 const process_info::symbol_info*
 process_info::find_symbol( const std::string& name ) const {
-  // Query address by the symbol name
-  typedef symbol_index::const_iterator itr;
-  std::pair<itr,itr> ret = m_symbol_name_index.equal_range(name);
-  if(ret.first == ret.second) {
-    return NULL;
+  if(name.compare(0,2,"0x") == 0) {
+    char* end;
+    const uintptr_t address = std::strtoul(name.c_str(),&end,16);
+    const symbol_info* sinfo = *end ? NULL : find_symbol(address);
+    if(!sinfo || sinfo->base != address) {
+      LOG(ERROR)<<"No function starts at address:"<<name<<"!";
+      return NULL;
+    }
+    return sinfo;
+  }
+
+  std::string::size_type pos = name.find('!');
+  if(pos != std::string::npos) {
+    const module_info* minfo = find_module(name.substr(0,pos));
+    if(!minfo) {
+      LOG(ERROR)<<"Cannot find module:"<<name.substr(0,pos)<<" for symbol:"
+        <<name<<"!";
+      return NULL;
+    }
+    return symbols_of(*minfo).find(
+        base::string_ref(name.c_str()+pos+1,name.size()-pos-1));
+  }
+
+  BOOST_FOREACH(const module_info* minfo, m_load_order) {
+    const symbol_info* sinfo = symbols_of(*minfo).find(name);
+    if(sinfo) return sinfo;
+  }
+  return NULL;
+}
+
+namespace {
+struct symbol_base_less_than {
+  bool operator () ( const process_info::symbol_info* l ,
+      const process_info::symbol_info* r ) const {
+    return l->base < r->base;
+  }
+};
+
+struct symbol_base_equal {
+  bool operator () ( const process_info::symbol_info* l ,
+      const process_info::symbol_info* r ) const {
+    return l->base == r->base;
+  }
+};
+} // namespace
+
+bool process_info::find_symbols( const std::string& pattern ,
+    std::vector<const symbol_info*>* output ) const {
+  const module_info* minfo = NULL;
+  std::string text = pattern;
+  std::string::size_type pos = pattern.find('!');
+  if(pos != std::string::npos) {
+    minfo = find_module(pattern.substr(0,pos));
+    if(!minfo) {
+      LOG(ERROR)<<"Cannot find module:"<<pattern.substr(0,pos)
+        <<" for pattern:"<<pattern<<"!";
+      return false;
+    }
+    text = pattern.substr(pos+1);
   }
-  // Try to find a strong symbol
-  for( itr beg = ret.first ; beg != ret.second ; ++beg ) {
-    const symbol_info& sinfo = beg->second;
-    if(!sinfo.weak) {
-      return &sinfo;
+
+  if(!m_name_index) {
+    const uint64_t start = base::monotonic_us();
+    load_all_symbols();
+    m_name_index.reset( new name_index() );
+    BOOST_FOREACH(const module_info* module, m_load_order) {
+      const symbol_table& table = symbols_of(*module);
+      for( size_t i = 0 ; i < table.size() ; ++i )
+        m_name_index->push(&table,i);
     }
+    m_name_index->build();
+    LOG(INFO)<<"Build name index of "<<m_name_index->size()<<" symbols in "
+      <<base::monotonic_us() - start<<" us!";
   }
 
-  // Just return a weak symbol
-  return &ret.first->second;
+  std::vector<const symbol_info*> matches;
+  if(!m_name_index->match(text,minfo,&matches)) return false;
+  std::sort(matches.begin(),matches.end(),symbol_base_less_than());
+  matches.erase(std::unique(matches.begin(),matches.end(),
+        symbol_base_equal()),matches.end());
+  output->insert(output->end(),matches.begin(),matches.end());
+  return true;
 }
 
 const process_info::symbol_info*
 process_info::find_symbol( uintptr_t address ) const {
-  std::vector<symbol_info>::const_iterator itr =
-    std::lower_bound(m_symbol_info.begin(),m_symbol_info.end(),
-        address,
-        symbol_info_less_than());
-  if(itr == m_symbol_info.end()) return NULL;
-  const symbol_info& sinfo = *itr;
-  assert(address >= sinfo.base && address <= sinfo.base + sinfo.size);
-  return &sinfo;
+  const module_info* minfo = find_module(address);
+  if(!minfo) return NULL;
+  const symbol_info* sinfo = symbols_of(*minfo).find(address);
+  return sinfo ? sinfo : frame_symbol(*minfo,address);
+}
+
+size_t process_info::symbolize( const uintptr_t* addresses , size_t count ,
+    const symbol_info** output ) const {
+  size_t found = 0;
+  size_t i = 0;
+  while(i < count) {
+    const module_info* minfo = find_module(addresses[i]);
+    if(!minfo) {
+      output[i++] = NULL;
+      continue;
+    }
+    // Stack samples mostly stay in one module , take the whole run
+    size_t end = i + 1;
+    while(end < count && addresses[end] >= minfo->start &&
+          addresses[end] < minfo->end)
+      ++end;
+    symbols_of(*minfo).find(addresses+i,end-i,output+i);
+    for( ; i < end ; ++i ) {
+      if(!output[i]) output[i] = frame_symbol(*minfo,addresses[i]);
+      if(output[i]) ++found;
+    }
+  }
+  return found;
 }
 
-namespace bfs = boost::filesystem;
+namespace {
+// Options for every seized thread while the world is stopped
+const int kTraceOptions = PTRACE_O_TRACECLONE;
+} // namespace
 
 bool process_info::snapshot_thread_list( std::vector<pid_t>* output ) {
   std::string path = (boost::format("/proc/%d/task")%m_pid).str();
-  try {
-    if(bfs::exists(path) && bfs::is_directory(path)) {
-      bfs::directory_iterator itr(path);
-      bfs::directory_iterator end;
-      for( ; itr != end ; ++itr ) {
-        if(bfs::is_directory(itr->status())) {
-          try {
-            output->push_back(
-                boost::lexical_cast<pid_t>(itr->path().filename().string()));
-          } catch ( const boost::bad_lexical_cast& e ) {
-            LOG(WARNING)<<"Failed to convert thread in path:"
-              <<path<<" to pid_t with reason:"<<e.what();
-            continue;
-          }
+  DIR* dir = ::opendir(path.c_str());
+  if(dir == NULL) {
+    LOG(WARNING)<<"Cannot open directory:"<<path<<" with error:"
+      <<std::strerror(errno);
+    return false;
+  }
+  struct dirent* entry;
+  while((entry = ::readdir(dir)) != NULL) {
+    char* end;
+    long tid = std::strtol(entry->d_name,&end,10);
+    // Skip "." and ".."
+    if(*end != 0 || tid <= 0) continue;
+    output->push_back(static_cast<pid_t>(tid));
+  }
+  ::closedir(dir);
+  return true;
+}
+
+bool process_info::seize_threads( const std::vector<pid_t>& tlist ,
+    size_t* count ) {
+  BOOST_FOREACH(pid_t pid,tlist) {
+    if(m_thread_list.find(pid) != m_thread_list.end() ||
+       m_released_threads.count(pid))
+      continue;
+    if(!ptrace_seize(pid,kTraceOptions)) {
+      // The thread has exited after we take the snapshot
+      if(errno == ESRCH) continue;
+      return false;
+    }
+    m_thread_list.insert(
+        std::make_pair(pid,thread(pid,thread::RUNNING)));
+    ++*count;
+  }
+  return true;
+}
+
+bool process_info::interrupt_threads( std::set<pid_t>* pending ) {
+  for( thread_list::iterator itr = m_thread_list.begin() ;
+      itr != m_thread_list.end() ; ) {
+    if(itr->second.state == thread::RUNNING) {
+      if(!ptrace_interrupt(itr->second.pid)) {
+        if(errno == ESRCH) {
+          m_thread_list.erase(itr++);
+          continue;
         }
+        return false;
       }
+      pending->insert(itr->second.pid);
+    }
+    ++itr;
+  }
+  return true;
+}
+
+void process_info::mark_stopped( pid_t pid , std::set<pid_t>* pending ) {
+  thread_list::iterator itr = m_thread_list.find(pid);
+  if(itr == m_thread_list.end()) {
+    // A cloned thread that reports its stop before the clone event of
+    // its parent
+    m_thread_list.insert(std::make_pair(pid,thread(pid,thread::STOPPED)));
+  } else {
+    itr->second.state = thread::STOPPED;
+  }
+  pending->erase(pid);
+  // resume_all turns off the clone tracking , turn it on again
+  ptrace_set_options(pid,kTraceOptions);
+}
+
+bool process_info::wait_threads( std::set<pid_t>* pending ) {
+  while(!pending->empty()) {
+    int status;
+    errno = 0;
+    pid_t pid = ::waitpid(-1,&status,__WALL);
+    if(pid < 0) {
+      if(errno == EINTR) continue;
+      LOG(ERROR)<<"waitpid(-1) failed with:"<<std::strerror(errno);
+      return false;
+    }
+
+    if(WIFEXITED(status) || WIFSIGNALED(status)) {
+      pending->erase(pid);
+      m_thread_list.erase(pid);
+      continue;
+    }
+
+    if(!WIFSTOPPED(status)) continue;
+
+    const int event = status >> 16;
+    const int sig = WSTOPSIG(status);
+
+    if(event == PTRACE_EVENT_CLONE) {
+      // The new thread is attached automatically and it will report a
+      // stop by itself , wait for it unless it already did
+      unsigned long child;
+      if(ptrace_get_event_msg(pid,&child)) {
+        pid_t cpid = static_cast<pid_t>(child);
+        if(m_thread_list.find(cpid) == m_thread_list.end()) {
+          m_thread_list.insert(
+              std::make_pair(cpid,thread(cpid,thread::RUNNING)));
+          pending->insert(cpid);
+        }
+      }
+      if(pending->count(pid)) {
+        // The clone came before our interrupt , which is still pending.
+        // Let the thread go , it stops again with PTRACE_EVENT_STOP ;
+        // otherwise it would trap right after the next resume_all.
+        if((!ptrace_interrupt(pid) || !ptrace_continue(pid)) &&
+           errno != ESRCH)
+          return false;
+      } else {
+        mark_stopped(pid,pending);
+      }
+    } else if(event == 0 && pending->count(pid)) {
+      // Signal delivery stop that comes before our interrupt. Deliver the
+      // signal , the interrupt is still pending and it will stop the thread
+      // right after that
+      if(!handle_signal_stop(pid,sig)) return false;
+    } else {
+      mark_stopped(pid,pending);
     }
-  } catch( const bfs::filesystem_error& ex ) {
-    LOG(WARNING)<<"File system error when load thread info for pid:"
-      <<m_pid<<"with reason:"<<ex.what();
-    return false;
   }
   return true;
 }
 
-bool process_info::diff_thread_list( const std::vector<pid_t>& input ,
-    std::vector<pid_t>* output ) {
-  BOOST_FOREACH(pid_t pid,input) {
+bool process_info::handle_signal_stop( pid_t pid , int sig ) {
+  if(sig == SIGTRAP && m_traps) {
+    struct user_regs_struct regs;
+    if(!ptrace_getregs(pid,&regs)) return false;
+    // RIP points right after the int3
+    trap_map::const_iterator itr = m_traps->find(regs.rip-1);
+    if(itr != m_traps->end()) {
+      regs.rip = itr->second;
+      if(!ptrace_setregs(pid,regs)) return false;
+      return ptrace_continue(pid);
+    }
+  }
+  return ptrace_signal(pid,sig);
+}
+
+bool process_info::service_traps( uint64_t wait_us ) {
+  const uint64_t deadline = base::monotonic_us() + wait_us;
+  do {
+    int status;
+    errno = 0;
+    pid_t pid = ::waitpid(-1,&status,__WALL|WNOHANG);
+    if(pid < 0) {
+      if(errno == EINTR) continue;
+      // ECHILD , nobody is traced
+      return errno == ECHILD;
+    }
+    if(pid == 0) {
+      // Nothing is pending , poll again
+      if(base::monotonic_us() >= deadline) break;
+      ::usleep(100);
+      continue;
+    }
+    if(WIFEXITED(status) || WIFSIGNALED(status)) {
+      m_thread_list.erase(pid);
+      continue;
+    }
+    if(!WIFSTOPPED(status)) continue;
+    // A thread cloned while we follow clones , its first stop may come
+    // before the clone event of its parent
     if(m_thread_list.find(pid) == m_thread_list.end()) {
-      output->push_back(pid);
+      m_thread_list.insert(std::make_pair(pid,thread(pid,thread::RUNNING)));
+    }
+    const int event = status >> 16;
+    if(event == 0) {
+      if(!handle_signal_stop(pid,WSTOPSIG(status))) return false;
+    } else {
+      if(event == PTRACE_EVENT_CLONE) {
+        unsigned long child;
+        if(ptrace_get_event_msg(pid,&child) &&
+           m_thread_list.find(static_cast<pid_t>(child)) ==
+           m_thread_list.end()) {
+          m_thread_list.insert(std::make_pair(static_cast<pid_t>(child),
+                thread(static_cast<pid_t>(child),thread::RUNNING)));
+        }
+      }
+      // Event stop , nothing else to do with it but let the thread go
+      if(!ptrace_continue(pid)) return false;
+    }
+  } while(true);
+  return true;
+}
+
+namespace {
+// Visit a thread just to stop and resume it
+class nop_visitor : public process_info::thread_visitor {
+ public:
+  virtual bool visit( pid_t pid , struct user_regs_struct* regs ,
+      bool* modified ) {
+    (void)pid; (void)regs; (void)modified;
+    return true;
+  }
+};
+} // namespace
+
+bool process_info::follow_clones( bool on ) {
+  m_follow_clones = on;
+  // The options of a running thread can only be changed in a stop , each
+  // thread gets the new ones when visit_threads resumes it
+  nop_visitor visitor;
+  if(!visit_threads(&visitor)) return false;
+  if(!on) return true;
+
+  // Seize the threads created while nobody follows clones , the seized
+  // threads follow theirs , so we are done once a scan finds nothing new
+  size_t count;
+  do {
+    std::vector<pid_t> tlist;
+    if(!snapshot_thread_list(&tlist)) return false;
+    count = 0;
+    if(!seize_threads(tlist,&count)) return false;
+  } while(count != 0);
+  return true;
+}
+
+bool process_info::cpu_affinity( cpu_set_t* output ) const {
+  CPU_ZERO(output);
+  for( thread_list::const_iterator itr = m_thread_list.begin() ;
+      itr != m_thread_list.end() ; ++itr ) {
+    cpu_set_t one;
+    if(::sched_getaffinity(itr->second.pid,sizeof(one),&one)) {
+      // The thread is gone
+      if(errno == ESRCH) continue;
+      LOG(ERROR)<<"sched_getaffinity("<<itr->second.pid<<") failed with:"
+        <<std::strerror(errno);
+      return false;
+    }
+    CPU_OR(output,output,&one);
+  }
+  return true;
+}
+
+bool process_info::visit_threads( thread_visitor* visitor ) {
+  std::vector<pid_t> tlist;
+  for( thread_list::iterator itr = m_thread_list.begin() ;
+      itr != m_thread_list.end() ; ++itr ) {
+    tlist.push_back(itr->first);
+  }
+
+  BOOST_FOREACH(pid_t pid,tlist) {
+    thread_list::iterator itr = m_thread_list.find(pid);
+    if(itr == m_thread_list.end()) continue;
+    const bool running = itr->second.state == thread::RUNNING;
+    if(running) {
+      if(!stop_pid(pid)) return false;
+      // Exit while we stop it
+      if(m_thread_list.find(pid) == m_thread_list.end()) continue;
+    }
+
+    struct user_regs_struct regs;
+    bool modified = false;
+    if(!ptrace_getregs(pid,&regs)) return false;
+    if(!visitor->visit(pid,&regs,&modified)) return false;
+    if(modified && !ptrace_setregs(pid,regs)) return false;
+
+    if(running) {
+      ptrace_set_options(pid,m_follow_clones ? kTraceOptions : 0);
+      if(!ptrace_continue(pid)) return false;
+      m_thread_list.find(pid)->second.state = thread::RUNNING;
+    }
+  }
+  return true;
+}
+
+bool process_info::snapshot_registers( register_map* output ) const {
+  for( thread_list::const_iterator itr = m_thread_list.begin() ;
+      itr != m_thread_list.end() ; ++itr ) {
+    if(itr->second.state != thread::STOPPED) continue;
+    struct user_regs_struct regs;
+    if(!ptrace_getregs(itr->second.pid,&regs)) return false;
+    output->insert(std::make_pair(itr->second.pid,regs));
+  }
+  return true;
+}
+
+namespace {
+// How cheap it is to borrow a stopped thread. A thread sleeping until
+// something happens doesn't hold anything up while our code runs on it.
+// The syscall it sleeps in is restarted once the registers are restored ,
+// except the ones restarted through the restart block ( timed futex wait ,
+// nanosleep , poll ) which the code we run could reuse , so they come
+// second.
+int idle_rank( const struct user_regs_struct& regs ) {
+  // orig_rax is the syscall number , -1 outside of a syscall
+  if(static_cast<int64_t>(regs.orig_rax) < 0) return 0;
+  const int64_t kErestartRestartblock = 516;
+  if(static_cast<int64_t>(regs.rax) == -kErestartRestartblock) return 2;
+  switch(regs.orig_rax) {
+    case SYS_futex:
+    case SYS_epoll_wait:
+    case SYS_epoll_pwait:
+    case SYS_poll:
+    case SYS_ppoll:
+    case SYS_select:
+    case SYS_pselect6:
+    case SYS_nanosleep:
+    case SYS_clock_nanosleep:
+    case SYS_pause:
+    case SYS_rt_sigsuspend:
+    case SYS_rt_sigtimedwait:
+    case SYS_accept:
+    case SYS_accept4:
+    case SYS_wait4:
+      return 3;
+    default:
+      // Some other syscall blocks , probably a read
+      return 1;
+  }
+}
+} // namespace
+
+pid_t process_info::invoke_thread() {
+  const thread* t = get_thread(m_user_invoke_thread);
+  if(t && t->state == thread::STOPPED) return m_user_invoke_thread;
+  t = get_thread(m_invoke_thread);
+  if(t && t->state == thread::STOPPED) return m_invoke_thread;
+
+  register_map regs;
+  if(!snapshot_registers(&regs)) return 0;
+  int best_rank = -1;
+  m_invoke_thread = 0;
+  for( register_map::const_iterator itr = regs.begin() ;
+      itr != regs.end() ; ++itr ) {
+    // Among threads that are as idle , the main thread comes last
+    const int rank = idle_rank(itr->second) * 2 +
+      (itr->first == m_pid ? 0 : 1);
+    if(rank > best_rank) {
+      best_rank = rank;
+      m_invoke_thread = itr->first;
+    }
+  }
+  if(m_user_invoke_thread && m_invoke_thread) {
+    LOG(WARNING)<<"Thread:"<<m_user_invoke_thread<<" is not stopped , use "
+      "thread:"<<m_invoke_thread<<" to invoke code instead!";
+  }
+  LOG(INFO)<<"Invoke code on thread:"<<m_invoke_thread<<" of process:"
+    <<m_pid<<"!";
+  return m_invoke_thread;
+}
+
+bool process_info::single_step( pid_t pid , struct user_regs_struct* regs ,
+    std::vector<int>* signals ) {
+  do {
+    if(!ptrace_singlestep(pid,0)) return false;
+    int status;
+    pid_t p;
+    do {
+      errno = 0;
+      p = ::waitpid(pid,&status,__WALL);
+    } while(p < 0 && errno == EINTR);
+    if(p < 0) {
+      LOG(ERROR)<<"waitpid("<<pid<<") failed with:"<<std::strerror(errno);
+      return false;
+    }
+    if(!WIFSTOPPED(status)) {
+      LOG(ERROR)<<"Thread:"<<pid<<" exits while single stepping!";
+      m_thread_list.erase(pid);
+      return false;
+    }
+    if((status>>16) == 0) {
+      const int sig = WSTOPSIG(status);
+      if(sig == SIGTRAP) break;
+      // Some other signal comes in first , the step with signal 0 drops
+      // it and we send it again later
+      signals->push_back(sig);
+    }
+    // An event stop , the instruction is not executed yet
+  } while(true);
+  return ptrace_getregs(pid,regs);
+}
+
+bool process_info::queue_signals( pid_t pid ,
+    const std::vector<int>& signals ) {
+  BOOST_FOREACH(int sig, signals) {
+    if(::syscall(SYS_tgkill,m_pid,pid,sig)) {
+      LOG(ERROR)<<"Cannot send signal:"<<sig<<" to thread:"<<pid
+        <<" with error:"<<std::strerror(errno);
+      return false;
     }
   }
-  return output->empty();
+  return true;
 }
 
 bool process_info::attach_all() {
+  const uint64_t start = base::monotonic_us();
   std::vector<pid_t> tlist;
-  std::vector<pid_t> diff;
+  std::set<pid_t> pending;
 
+  bool world_stopped = false;
   do {
+    tlist.clear();
     if(!snapshot_thread_list(&tlist)) return false;
-    if(diff_thread_list(tlist,&diff)) {
+    size_t count = 0;
+    if(!seize_threads(tlist,&count)) return false;
+    // A thread resumed by resume_all doesn't follow its clones , so one it
+    // creates between the snapshot and our interrupt is missed. Only a
+    // snapshot taken while every thread we know is stopped and that finds
+    // nothing new tells that the world is stopped.
+    if(count == 0 && world_stopped) {
       sync_thread_status(tlist);
       break;
     }
-    BOOST_FOREACH(pid_t pid,diff) {
-      int status;
-      if(!ptrace_attach_and_wait(pid,&status))
-        return false;
-      m_thread_list.insert(
-          std::make_pair(pid,thread(pid,thread::STOPPED)));
-    }
-    tlist.clear();
-    diff.clear();
-  }while(true);
+    if(!interrupt_threads(&pending)) return false;
+    if(!wait_threads(&pending)) return false;
+    world_stopped = true;
+  } while(true);
+
+  // Threads may sleep in other places now
+  m_invoke_thread = 0;
+  m_stop_duration = base::monotonic_us() - start;
+  LOG(INFO)<<"Stop "<<m_thread_list.size()<<" threads of process:"<<m_pid
+    <<" in "<<m_stop_duration<<" us!";
   return true;
 }
 
 bool process_info::stop_pid( pid_t pid ) {
-  errno = 0;
-  if(::kill(pid,SIGSTOP)) {
-    if(errno == ESRCH) {
-      return true;
-    } else {
-      LOG(ERROR)<<"kill("<<pid<<") failed with:"<<
+  if(!ptrace_interrupt(pid)) {
+    return errno == ESRCH;
+  }
+  std::set<pid_t> pending;
+  pending.insert(pid);
+  while(pending.count(pid)) {
+    int status;
+    errno = 0;
+    pid_t p = ::waitpid(pid,&status,__WALL);
+    if(p < 0) {
+      if(errno == EINTR) continue;
+      LOG(ERROR)<<"waitpid("<<pid<<") failed with:"<<
         std::strerror(errno);
       return false;
     }
+    assert(p == pid);
+    if(WIFEXITED(status) || WIFSIGNALED(status)) {
+      m_thread_list.erase(pid);
+      return true;
+    }
+    if(WIFSTOPPED(status) && (status>>16) == 0) {
+      // Deliver the signal , our interrupt comes right after it
+      if(!handle_signal_stop(pid,WSTOPSIG(status))) return false;
+      continue;
+    }
+    if(WIFSTOPPED(status) && (status>>16) == PTRACE_EVENT_CLONE) {
+      // Same as wait_threads , the new thread reports its own stop to
+      // whoever waits for the process next
+      unsigned long child;
+      if(ptrace_get_event_msg(pid,&child)) {
+        const pid_t cpid = static_cast<pid_t>(child);
+        if(m_thread_list.find(cpid) == m_thread_list.end())
+          m_thread_list.insert(
+              std::make_pair(cpid,thread(cpid,thread::RUNNING)));
+      }
+      if((!ptrace_interrupt(pid) || !ptrace_continue(pid)) &&
+         errno != ESRCH)
+        return false;
+      continue;
+    }
+    mark_stopped(pid,&pending);
   }
-  errno = 0;
-  int status;
-  pid_t p = ::waitpid(pid,&status,__WALL);
-  if(errno) {
-    LOG(ERROR)<<"waitpid("<<pid<<") failed with:"<<
-      std::strerror(errno);
-    return false;
-  }
-  assert(p == pid);
-  (void)status; // Don't care about the signal code
   return true;
 }
 
 bool process_info::stop_all() {
-  std::vector<pid_t> tlist;
-  std::vector<pid_t> diff;
-
-  // 1. Stop all attached threads
-  for( thread_list::iterator itr = m_thread_list.begin() ;
-      itr != m_thread_list.end() ; ++itr ) {
-    if(itr->second.state == thread::RUNNING) {
-      if(!stop_pid(itr->second.pid)) return false;
-    }
-  }
-  // 2. Attach all the rest thread. In case ~
+  // Interrupt all the attached threads and seize the rest ones
   return attach_all();
 }
 
 bool process_info::resume_all() {
+  if(!commit_memory())
+    return false;
   for( thread_list::iterator itr = m_thread_list.begin() ;
       itr != m_thread_list.end() ; ++itr ) {
     if(itr->second.state == thread::STOPPED) {
+      // Don't follow clones while running unless someone serves the clone
+      // events , otherwise the thread that creates a new thread is stopped
+      // until we wait for it
+      ptrace_set_options(itr->second.pid,m_follow_clones ? kTraceOptions : 0);
       if(!ptrace_continue(itr->second.pid))
         return false;
       itr->second.state = thread::RUNNING;
@@ -356,6 +1566,19 @@ bool process_info::resume_all() {
   return true;
 }
 
+bool process_info::release_thread( pid_t pid ) {
+  int status;
+  if(::waitpid(pid,&status,__WALL) != pid) {
+    LOG(ERROR)<<"waitpid("<<pid<<") failed with:"<<std::strerror(errno);
+    return false;
+  }
+  m_thread_list.erase(pid);
+  m_released_threads.insert(pid);
+  if(!WIFSTOPPED(status)) return true;
+  LOG(INFO)<<"Release thread:"<<pid<<" created by injected code!";
+  return ptrace_detach(pid);
+}
+
 bool process_info::resume_and_wait( pid_t pid , int* status ) {
   thread_list::iterator itr = m_thread_list.find(pid);
   if(itr == m_thread_list.end()) {
@@ -368,6 +1591,8 @@ bool process_info::resume_and_wait( pid_t pid , int* status ) {
       "However it is running!";
     return false;
   }
+  if(!commit_memory())
+    return false;
   if(!ptrace_cont_and_wait_event(pid,status))
     return false;
   return true;
@@ -412,21 +1637,59 @@ void process_info::dump( std::ostream& output ) const {
   output<<"Process path:"<<path()<<"\n";
   output<<"Pid:"<<m_pid<<"\n";
   output<<"Symbol Table\n";
-  BOOST_FOREACH(const symbol_info& sinfo, m_symbol_info) {
-    output<<"Name:"<<sinfo.name<<" "
-      <<"Weak:"<<std::boolalpha<<sinfo.weak<<std::noboolalpha<<" "
-      <<"Base:"<<std::hex<<sinfo.base<<" "
-      <<"Offset:"<<sinfo.size<<std::dec<<"\n";
+  size_t count = 0 , bytes = 0;
+  for( symbol_table_map::const_iterator itr = m_symbol_tables.begin() ;
+      itr != m_symbol_tables.end() ; ++itr ) {
+    const symbol_table& table = *itr->second;
+    for( size_t i = 0 ; i < table.size() ; ++i ) {
+      output<<"Name:"<<table.name(i)<<" "
+        <<"Weak:"<<std::boolalpha<<table.weak(i)<<std::noboolalpha<<" "
+        <<"Base:"<<std::hex<<table.base(i)<<" "
+        <<"Offset:"<<table.symbol_size(i)<<std::dec<<"\n";
+    }
+    count += table.size();
+    bytes += table.memory_usage();
   }
+  output<<"Symbols:"<<count<<" Memory:"<<bytes<<" bytes";
+  if(count) output<<" ( "<<bytes / count<<" per symbol )";
+  output<<"\n";
 }
 
-process_info::process_info( pid_t pid ):
+process_info::process_info( pid_t pid , int memory_backend ,
+    int symbol_loader ):
   m_modules(),
+  m_load_order(),
+  m_address_order(),
+  m_module_index(),
   m_pid(pid),
   m_entry_info(),
-  m_symbol_info(),
-  m_symbol_name_index(),
-  m_thread_list()
+  m_symbol_tables(),
+  m_thread_list(),
+  m_released_threads(),
+  m_stop_duration(0),
+  m_follow_clones(false),
+  m_invoke_thread(0),
+  m_user_invoke_thread(0),
+  m_symbol_loader(symbol_loader),
+  m_symbol_threads(1),
+  m_load_duration(0),
+  m_images(),
+  m_resolvers(),
+  m_dynamic_symbols(),
+  m_name_index(),
+  m_symbol_cache_dir(),
+  m_traps(NULL),
+  m_memory(new remote_memory(pid,memory_backend)),
+  m_shadow(new shadow_memory(m_memory.get())),
+  m_scratch(0),
+  m_scratch_size(0)
 {}
 
+process_info::~process_info() {
+  // Flush whatever is left , typically the recovery of patched functions
+  if(m_shadow->dirty() && !m_shadow->commit()) {
+    LOG(ERROR)<<"Cannot flush pending modification into process:"<<m_pid;
+  }
+}
+
 } // namespace dynhook
@@ -1,6 +1,10 @@
 #ifndef PROCESS_INFO_H_
 #define PROCESS_INFO_H_
 #include "base.h"
+#include "remote_memory.h"
+#include "shadow_memory.h"
+#include "elf_image.h"
+#include "address_index.h"
 #include <vector>
 #include <set>
 #include <map>
@@ -10,39 +14,81 @@
 #include <memory>
 #include <iostream>
 #include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/ptr_container/ptr_map.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 
 #include <inttypes.h>
+#include <sys/user.h>
+#include <sched.h>
+#include <elf.h>
+
+struct Elf;
 
 namespace dynhook {
+class symbol_table;
+class gnu_hash_resolver;
+class symbol_cache;
+class name_index;
+class frame_index;
+struct function_analysis;
 
 // A data structure that is used to store all the process required
 // information during the debugging session
 class process_info : private boost::noncopyable {
  public:
-  // Create a process_info information entry with given PID value
-  static process_info* create( pid_t pid ) {
-    std::auto_ptr<process_info> ret( new process_info(pid) );
+  // How the symbol tables of the modules are loaded
+  enum {
+    MMAP_LOADER,  // Walk the mapped file in place , see elf_image
+    LIBELF_LOADER // Go through libelf , kept for comparison
+  };
+
+  static int parse_symbol_loader( const std::string& name );
+
+  // Create a process_info information entry with given PID value. The
+  // memory_backend specifies how we talk to the remote memory , see
+  // remote_memory for detail.
+  static process_info* create( pid_t pid ,
+      int memory_backend = remote_memory::PROC_MEM ,
+      int symbol_loader = MMAP_LOADER ) {
+    std::auto_ptr<process_info> ret( new process_info(pid,memory_backend,
+          symbol_loader) );
     if(!ret->init()) return NULL;
     return ret.release();
   }
 
  public:
 
+  // A module is represented by its executable mapping
   struct module_info {
     uintptr_t start;
     uintptr_t end;
+    uintptr_t offset; // File offset that is mapped at start
+    uintptr_t bias;   // Load bias , what st_value is relocated by
+    uintptr_t header; // Where file offset 0 is mapped , 0 if unknown
+    uint64_t dynamic; // p_vaddr of PT_DYNAMIC from the link_map , 0 if unknown
     std::string path;
     module_info():
       start(0),
       end(0),
+      offset(0),
+      bias(0),
+      header(0),
+      dynamic(0),
       path()
     {}
 
     module_info( uintptr_t s ,
         uintptr_t e ,
+        uintptr_t o ,
+        uintptr_t b ,
         const std::string& p ):
       start(s),
       end(e),
+      offset(o),
+      bias(b),
+      header(0),
+      dynamic(0),
       path(p)
     {}
   };
@@ -64,32 +110,79 @@ class process_info : private boost::noncopyable {
   // Find symbol by address
   struct symbol_info {
     uintptr_t base; // Base address for this symbol
-    std::string name; // Name for this symbol
+    base::string_ref name; // Name for this symbol , owned by process_info
     size_t size;
     bool weak;
+    const module_info* module; // Module that defines this symbol
+    const function_analysis* analysis; // From the symbol cache , or NULL
+
+    // An STT_GNU_IFUNC symbol , base is its resolver and not the function.
+    // See resolve_ifunc for the function the process really calls.
+    bool ifunc;
 
     symbol_info():
       base(0),
       name(),
       size(0),
-      weak(false)
+      weak(false),
+      module(NULL),
+      analysis(NULL),
+      ifunc(false)
     {}
 
     symbol_info( uintptr_t b ,
-        const std::string& n ,
+        const base::string_ref& n ,
         size_t sz ,
-        bool w ):
+        bool w ,
+        const module_info* m ,
+        const function_analysis* a = NULL ,
+        bool i = false ):
       base(b),
       name(n),
       size(sz),
-      weak(w)
+      weak(w),
+      module(m),
+      analysis(a),
+      ifunc(i)
     {}
   };
 
+  // Find symbol by name. Symbol tables are loaded lazily : modules are
+  // scanned in load order and the first module that defines the name wins,
+  // the rest are not even parsed. A name like "libfoo.so!func" only looks
+  // into the module whose file name is ( or starts with ) "libfoo.so". A
+  // hex address like "0x401000" is the function that starts there , which
+  // also works for a stripped module , see find_symbol by address.
   const symbol_info* find_symbol( const std::string& ) const;
 
+  // Find a function exported by the dynamic symbol table of a module , for
+  // example the libc functions our stubs call. Modules are searched in load
+  // order through their DT_GNU_HASH table , which costs a few lookups
+  // instead of loading the whole symbol table.
+  const symbol_info* find_dynamic_symbol( const std::string& ) const;
+
+  // Find the symbols whose demangled name matches a pattern , see
+  // name_index for the syntax. "Module!Pattern" only matches the symbols
+  // of the module. The first call loads every symbol table and builds the
+  // index. Aliases of the same function are reported once. False if the
+  // pattern is broken.
+  bool find_symbols( const std::string& pattern ,
+      std::vector<const symbol_info*>* output ) const;
+
+  // Find symbol by address. The module that covers the address is loaded
+  // on demand , the result is valid until the next lookup loads a module.
+  // An address no symbol covers , in a stripped module for example , gets
+  // the function around it from .eh_frame_hdr , see frame_index ; such a
+  // symbol is named after its address.
   const symbol_info* find_symbol( uintptr_t address ) const;
 
+  // Find the symbols of count addresses , for example the return addresses
+  // captured by a hook. A run of addresses in the same module is searched
+  // as one batch , see address_index. NULL is stored for an address that
+  // no symbol covers. Returns how many addresses are found.
+  size_t symbolize( const uintptr_t* addresses , size_t count ,
+      const symbol_info** output ) const;
+
   pid_t pid() const {
     return m_pid;
   }
@@ -102,39 +195,51 @@ class process_info : private boost::noncopyable {
     return m_entry_info;
   }
 
- private:
-  // For std::lower_bound
-  struct symbol_info_less_than {
-    bool operator ()( const symbol_info& l ,
-        const symbol_info& r ) const {
-      return l.base < r.base;
-    }
-    bool operator ()( const symbol_info& l ,
-        uintptr_t address ) const {
-      return l.base < address;
-    }
-    bool operator () ( uintptr_t address ,
-        const symbol_info& r ) {
-      return address < r.base;
-    }
-  };
+  // Transport used to read/write the memory of this process
+  remote_memory* memory() const {
+    return m_memory.get();
+  }
+
+  // Shadow copy of the code pages we read and patch. Modification goes
+  // into the shadow and is flushed by commit_memory , which is called
+  // automatically before any thread of the target process is resumed.
+  shadow_memory* shadow() const {
+    return m_shadow.get();
+  }
+
+  bool commit_memory() {
+    return m_shadow->commit();
+  }
 
-  void push_symbol_info( const symbol_info& info ) {
-    std::vector<symbol_info>::iterator itr =
-      std::lower_bound(m_symbol_info.begin(),m_symbol_info.end(),
-          info,
-          symbol_info_less_than());
-    std::vector<symbol_info>::iterator pos =
-      m_symbol_info.insert(itr,info);
-    m_symbol_name_index.insert(std::make_pair(info.name,*pos));
+  // Private RWX area where invoke runs the stubs , 0 until the first
+  // invoke maps it
+  uintptr_t scratch() const {
+    return m_scratch;
   }
 
+  size_t scratch_size() const {
+    return m_scratch_size;
+  }
+
+  void set_scratch( uintptr_t address , size_t size ) {
+    m_scratch = address;
+    m_scratch_size = size;
+  }
+
+  ~process_info();
+
+ private:
   // Helper
   bool is_abs_path( const std::string& str ) const {
     return str.size() > 0 && str[0] == '/';
   }
 
  public: // Task list manipulation
+  // Attach and stop every thread of the process. All the threads are
+  // seized first and then interrupted in one sweep , the stop notification
+  // is collected in whatever order it comes. Threads cloned while we stop
+  // them are followed by PTRACE_O_TRACECLONE , and the task directory is
+  // scanned again once everything is stopped until it has nothing new.
   bool attach_all();
   bool stop_all();
   bool resume_all();
@@ -157,53 +262,332 @@ class process_info : private boost::noncopyable {
 
   const thread* get_thread( pid_t pid ) const;
 
+  // Let a thread that our own code has created run untraced , for example
+  // the agent thread. It is auto attached and waits for us in its first
+  // stop. It is never attached again , so it doesn't run our stubs and it
+  // keeps running while the process is stopped.
+  bool release_thread( pid_t );
+
+  // The stopped thread that runs the code of invoke. The thread set by
+  // set_invoke_thread wins if it is stopped. Otherwise we prefer a thread
+  // sleeping in a blocking syscall , like futex or epoll_wait , over one
+  // that is running user code, and any thread over the main thread ,
+  // which is usually the event loop. The choice is kept until the next
+  // stop_all. 0 if no thread is stopped.
+  pid_t invoke_thread();
+
+  void set_invoke_thread( pid_t tid ) {
+    m_user_invoke_thread = tid;
+  }
+
+  // How long the last attach_all/stop_all takes to stop the world , in
+  // micro seconds
+  uint64_t stop_duration() const {
+    return m_stop_duration;
+  }
+
+  // Load and store symbol tables through the cache in this directory , see
+  // symbol_cache. It must be set before the first lookup.
+  void set_symbol_cache( const std::string& dir ) {
+    m_symbol_cache_dir = dir;
+  }
+
+  // Load the symbol tables of all the modules that are not loaded yet on
+  // a pool of worker threads , each one builds the tables of the modules
+  // it picks up. Only what needs every table calls it : the patterns of
+  // find_symbols and the --debug dump. find_symbol stays lazy.
+  void load_all_symbols() const;
+
+  // Number of worker threads used by load_all_symbols , 1 disables them
+  void set_symbol_threads( size_t threads ) {
+    m_symbol_threads = std::max<size_t>(threads,1);
+  }
+
+  // How long loading the symbol tables takes so far , in micro seconds
+  uint64_t load_duration() const {
+    return m_load_duration;
+  }
+
+  // Trap routes : when a seized thread stops with SIGTRAP right after an
+  // int3 placed at the key address , it is resumed at the mapped address
+  // instead of getting the signal. Used while patching a running process.
+  typedef std::map<uintptr_t,uintptr_t> trap_map;
+
+  void set_trap_routes( const trap_map* traps ) {
+    m_traps = traps;
+  }
+
+  // Handle the stop notification of running seized threads, wait at most
+  // wait_us micro seconds for them. A thread cloned while we follow clones
+  // is added to the thread list.
+  bool service_traps( uint64_t wait_us );
+
+  // Follow the clones of running threads , after that every thread that
+  // shows up is seized. The clone events must be served by service_traps
+  // until it is turned off again. Each running thread is stopped for a
+  // moment to change its options.
+  bool follow_clones( bool on );
+
+  // Union of the CPUs the threads of the process may run on
+  bool cpu_affinity( cpu_set_t* output ) const;
+
+  // Visit the threads one by one. A running thread is stopped , visited
+  // and resumed before the next one is stopped, so at most one thread is
+  // stopped by us at any time.
+  class thread_visitor {
+   public:
+    // Set modified to true if the registers needs to be written back
+    virtual bool visit( pid_t pid , struct user_regs_struct* regs ,
+        bool* modified ) = 0;
+    virtual ~thread_visitor() {}
+  };
+
+  bool visit_threads( thread_visitor* visitor );
+
+  // Registers of all the stopped threads , read in one pass
+  typedef std::map<pid_t,struct user_regs_struct> register_map;
+  bool snapshot_registers( register_map* output ) const;
+
+  // Execute one instruction of a stopped thread and get its new registers.
+  // A signal that comes in meanwhile is not delivered , since its handler
+  // would return into the code we step through ; it is appended to
+  // signals and must be given back by queue_signals.
+  bool single_step( pid_t pid , struct user_regs_struct* regs ,
+      std::vector<int>* signals );
+
+  // Send the signals to the thread again , they are delivered once it runs
+  bool queue_signals( pid_t pid , const std::vector<int>& signals );
+
  public:
   // Dump the process information into the output stream
   void dump( std::ostream& output ) const;
 
  private: // Initialization routines
   bool load_process_thread_info( pid_t );
+
+  // Modules are discovered by walking the link_map list of the dynamic
+  // linker : auxv gives the program headers of the executable , its
+  // DT_DEBUG entry gives r_debug and every link_map has the load bias and
+  // the dynamic section of its module. The program headers of a module
+  // are read from its ELF header in the process , or its code mapping is
+  // taken from the maps file if they cannot be. The maps file alone is
+  // used when the walk fails , for example for a static executable.
+  bool load_link_map();
   bool load_process_so_list( pid_t );
 
-  bool parse_process_module_line( const std::string& line ,
-      module_info* );
+  // A mapping of a file in the maps file
+  struct file_mapping {
+    module_info range; // start , end , offset and path
+    bool executable;
+  };
+  typedef std::vector<file_mapping> file_mapping_list;
+
+  // Every mapping of a file in the maps file , in address order
+  bool load_file_mappings( pid_t , file_mapping_list* output ) const;
+
+  // The mapping that covers the address , NULL if there's none
+  static const file_mapping* mapping_at( const file_mapping_list& ,
+      uintptr_t address );
+
+  // Where file offset 0 of the file is mapped first , the ELF header , 0 if
+  // it is not mapped
+  static uintptr_t header_of( const file_mapping_list& ,
+      const std::string& path );
+
+  // The first executable mapping of the file , NULL if there's none
+  static const file_mapping* code_of( const file_mapping_list& ,
+      const std::string& path );
+
+  // Program headers of the ELF header at the address of the remote memory
+  bool remote_program_headers( uintptr_t header , const std::string& path ,
+      std::vector<Elf64_Phdr>* output ) const;
+
+  // Add a module discovered by one of the above , false if it is known
+  bool add_module( const module_info& );
+
+  // Executable mapping of a module from its program headers
+  bool load_module_range( const Elf64_Phdr* phdrs , size_t count ,
+      module_info* output ) const;
+
+  // Parse one line of the maps file , false if it is not a mapping of a
+  // file. executable tells whether the mapping is the code of a module.
+  bool parse_process_module_line( const char* line , const char* end ,
+      module_info* , bool* executable ) const;
+
+  bool read_remote_string( uintptr_t address , std::string* output ) const;
+
+  // Symbol table of the module , loaded unless it is done already
+  const symbol_table& symbols_of( const module_info& ) const;
+
+  // Loading the symbol table of one module. prepare_load and finish_load
+  // touch the caches of process_info ; run_load only touches the job , so
+  // the jobs of different modules can run on different threads.
+  struct load_job {
+    const module_info* module;
+    const elf_image* image;  // NULL if the file cannot be mapped
+    const frame_index* frames; // Sizes the symbols without one , or NULL
+    symbol_table* table;     // Output , owned by the job until finished
+    symbol_cache* cache;     // Cache file the table comes from , or NULL
+    Elf* elf;                // Handle of the libelf loader , or NULL
+    std::string* names;      // Names read from the remote memory , or NULL
+    const char* loader;
+    uint64_t duration;
+
+    load_job();
+    ~load_job();
+  };
+
+  void prepare_load( const module_info& , load_job* ) const;
+  void run_load( load_job* ) const;
+  const symbol_table& finish_load( load_job* ) const;
+
+  struct load_queue;
+  static void* load_worker( void* );
+
+  bool load_symbol_info( load_job* ) const;
+  bool load_symbol_info_mmap( const module_info& , const elf_image* ,
+      symbol_table* ) const;
+  bool load_symbol_info_libelf( const module_info& , const elf_image* ,
+      symbol_table* , Elf** ) const;
+  bool load_symbol_info_remote( load_job* ) const;
+
+  // Mapped file of the module , NULL if it cannot be mapped. The file is
+  // opened through /proc/<pid>/map_files first , which is the file the
+  // process really maps even if it is deleted or lives in another mount
+  // namespace , and through the path in the maps file otherwise.
+  const elf_image* image_of( const module_info& ) const;
+
+  // Find the load bias and the dynamic section of a module in the remote
+  // memory , for modules whose file cannot be opened at all. The link_map
+  // gives both , otherwise they come from the ELF header in the mapping of
+  // file offset 0
+  bool remote_dynamic_of( const module_info& , uintptr_t* bias ,
+      uint64_t* dynamic ) const;
+
+  // GNU hash resolver of the module , NULL if the module doesn't have one
+  const gnu_hash_resolver* resolver_of( const module_info& ) const;
+
+  // Function boundaries of the module , NULL if the file cannot be mapped
+  // or has no .eh_frame_hdr
+  const frame_index* frames_of( const module_info& ) const;
+
+  // The function around the address from the frame index , NULL if there's
+  // none. It is kept until process_info is gone.
+  const symbol_info* frame_symbol( const module_info& ,
+      uintptr_t address ) const;
+
+  // Turns a st_value of the module into the address in the process
+  uintptr_t module_offset( const module_info& minfo ) const {
+    return minfo.bias;
+  }
 
-  bool load_symbol_info();
-  bool load_symbol_info( const module_info& );
+  const module_info* find_module( const std::string& name ) const;
+  const module_info* find_module( uintptr_t address ) const;
 
   // Used to do double initialization
   bool init();
 
-  process_info( pid_t );
+  process_info( pid_t , int memory_backend , int symbol_loader );
 
  private:
   bool stop_pid( pid_t );
   bool snapshot_thread_list(std::vector<pid_t>*);
-  bool diff_thread_list( const std::vector<pid_t>& ,
-      std::vector<pid_t>* );
+  bool seize_threads( const std::vector<pid_t>& , size_t* count );
+  bool interrupt_threads( std::set<pid_t>* pending );
+  bool wait_threads( std::set<pid_t>* pending );
+  void mark_stopped( pid_t , std::set<pid_t>* pending );
+  bool handle_signal_stop( pid_t , int sig );
   void sync_thread_status( const std::vector<pid_t>& );
 
  private:
   // Module list
   module_list m_modules;
 
+  // Modules in the order they show up in the maps file
+  std::vector<const module_info*> m_load_order;
+
+  // Modules sorted by the start address , and the index of the starts
+  std::vector<const module_info*> m_address_order;
+  address_index m_module_index;
+
   // Process Id for this process
   pid_t m_pid;
 
   // Process's module
   module_info m_entry_info;
 
-  // Data structure that stores symbol info
-  std::vector<symbol_info> m_symbol_info;
+  // Symbol tables are loaded on demand by the const lookups , so all the
+  // symbol related members are caches
 
-  // Index data structure that is used for searching the symbols
-  typedef std::multimap<std::string,symbol_info> symbol_index;
-  symbol_index m_symbol_name_index;
+  // Symbol table per module , a module that fails to load gets an empty
+  // one so we don't retry
+  typedef boost::ptr_map<const module_info*,symbol_table> symbol_table_map;
+  mutable symbol_table_map m_symbol_tables;
 
   // List of threads status
   typedef std::map<pid_t,thread> thread_list;
 
   thread_list m_thread_list;
+
+  // Threads created by our own code , see release_thread
+  std::set<pid_t> m_released_threads;
+
+  // Duration of the last stop the world
+  uint64_t m_stop_duration;
+
+  // Whether the resumed threads follow their clones
+  bool m_follow_clones;
+
+  // Thread picked by invoke_thread and the one the user asks for
+  pid_t m_invoke_thread;
+  pid_t m_user_invoke_thread;
+
+  // How symbol tables are loaded and how long it takes
+  int m_symbol_loader;
+  size_t m_symbol_threads;
+  mutable uint64_t m_load_duration;
+
+  // Mapped files of the modules , the tables copy the names out of them
+  mutable boost::ptr_map<const module_info*,elf_image> m_images;
+
+  // GNU hash resolver per module , NULL if the module has no such table
+  typedef boost::ptr_map<const module_info*,
+          boost::nullable<gnu_hash_resolver> > resolver_map;
+  mutable resolver_map m_resolvers;
+
+  // Frame index per module , NULL if the module has no such table
+  typedef boost::ptr_map<const module_info*,
+          boost::nullable<frame_index> > frame_index_map;
+  mutable frame_index_map m_frames;
+
+  // Symbols made up by frame_symbol , by address
+  struct frame_symbol_info {
+    std::string name;
+    symbol_info info;
+  };
+  mutable boost::ptr_map<uintptr_t,frame_symbol_info> m_frame_symbols;
+
+  // Symbols found by find_dynamic_symbol , the key owns the name
+  mutable std::map<std::string,symbol_info> m_dynamic_symbols;
+
+  // Demangled names of all the symbols , built by the first find_symbols
+  mutable boost::scoped_ptr<name_index> m_name_index;
+
+  // Directory of the symbol cache , empty if it is not used
+  std::string m_symbol_cache_dir;
+
+  // Current trap routes , NULL if we don't expect any trap
+  const trap_map* m_traps;
+
+  // Remote memory transport
+  boost::scoped_ptr<remote_memory> m_memory;
+
+  // Shadow cache on top of the transport
+  boost::scoped_ptr<shadow_memory> m_shadow;
+
+  // Scratch area of invoke
+  uintptr_t m_scratch;
+  size_t m_scratch_size;
 };
 
 } // namespace dynhook
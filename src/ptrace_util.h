@@ -82,6 +82,17 @@ inline bool ptrace_signal( pid_t pid , int sig ) {
   return true;
 }
 
+inline bool ptrace_singlestep( pid_t pid , int sig ) {
+  errno = 0;
+  ::ptrace(PTRACE_SINGLESTEP,pid,0,sig);
+  if(errno) {
+    LOG(ERROR)<<"ptrace(PTRACE_SINGLESTEP,"<<pid<<") failed with:"
+      <<std::strerror(errno);
+    return false;
+  }
+  return true;
+}
+
 inline bool ptrace_cont_and_wait_event( pid_t pid , int* status ) {
   if(!ptrace_continue(pid))
     return false;
@@ -122,5 +133,63 @@ inline bool ptrace_attach_and_wait( pid_t pid , int* status ) {
   return true;
 }
 
+// Attach without stopping the tracee , the options are set atomically
+// with the attach so a thread can never clone an untraced child after
+// we seize it
+inline bool ptrace_seize( pid_t pid , int options ) {
+  errno = 0;
+  ::ptrace(PTRACE_SEIZE,pid,0,options);
+  if(errno) {
+    LOG(ERROR)<<"ptrace(PTRACE_SEIZE,"<<pid<<") failed with:"
+      <<std::strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+inline bool ptrace_interrupt( pid_t pid ) {
+  errno = 0;
+  ::ptrace(PTRACE_INTERRUPT,pid,0,0);
+  if(errno) {
+    LOG(ERROR)<<"ptrace(PTRACE_INTERRUPT,"<<pid<<") failed with:"
+      <<std::strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+inline bool ptrace_set_options( pid_t pid , int options ) {
+  errno = 0;
+  ::ptrace(PTRACE_SETOPTIONS,pid,0,options);
+  if(errno) {
+    LOG(ERROR)<<"ptrace(PTRACE_SETOPTIONS,"<<pid<<","<<options
+      <<") failed with:"<<std::strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+inline bool ptrace_detach( pid_t pid ) {
+  errno = 0;
+  ::ptrace(PTRACE_DETACH,pid,0,0);
+  if(errno) {
+    LOG(ERROR)<<"ptrace(PTRACE_DETACH,"<<pid<<") failed with:"
+      <<std::strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+inline bool ptrace_get_event_msg( pid_t pid , unsigned long* msg ) {
+  errno = 0;
+  ::ptrace(PTRACE_GETEVENTMSG,pid,0,msg);
+  if(errno) {
+    LOG(ERROR)<<"ptrace(PTRACE_GETEVENTMSG,"<<pid<<") failed with:"
+      <<std::strerror(errno);
+    return false;
+  }
+  return true;
+}
+
 } // namespace dynhook
 #endif // PTRACE_UTIL_H_
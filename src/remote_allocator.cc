@@ -132,6 +132,7 @@ uintptr_t remote_allocator::allocate( size_t cap , uintptr_t hint ) {
       // Try high pool since low pool may not be able to allocate
       return m_high_pool->allocate(cap);
     }
+    return ret;
   } else {
     return m_high_pool->allocate(cap);
   }
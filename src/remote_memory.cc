@@ -0,0 +1,237 @@
+#include "remote_memory.h"
+#include "ptrace_util.h"
+
+#include <errno.h>
+#include <cassert>
+#include <cstring>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <glog/logging.h>
+#include <boost/format.hpp>
+
+namespace dynhook {
+
+namespace {
+int open_proc_mem( pid_t pid , int backend ) {
+  if(backend != remote_memory::PROC_MEM) return -1;
+  std::string path = (boost::format("/proc/%d/mem")%pid).str();
+  int fd = ::open(path.c_str(),O_RDWR|O_CLOEXEC);
+  if(fd < 0) {
+    LOG(WARNING)<<"Cannot open file:"<<path<<" with error:"
+      <<std::strerror(errno)<<", fall back to process_vm_readv/writev!";
+  }
+  return fd;
+}
+} // namespace
+
+remote_memory::remote_memory( pid_t pid , int backend ):
+  m_pid(pid),
+  m_backend(backend),
+  m_vm_supported(true),
+  m_mem_fd(open_proc_mem(pid,backend)),
+  m_stats()
+{
+  if(m_backend == PROC_MEM && !m_mem_fd)
+    m_backend = VM;
+}
+
+int remote_memory::parse_backend( const std::string& name ) {
+  if(name == "ptrace") return PTRACE;
+  if(name == "vm") return VM;
+  if(name == "procmem") return PROC_MEM;
+  return -1;
+}
+
+const char* remote_memory::backend_name( int backend ) {
+  switch(backend) {
+    case PTRACE:  return "ptrace";
+    case VM:      return "vm";
+    case PROC_MEM:return "procmem";
+    default: assert(0); return NULL;
+  }
+}
+
+void remote_memory::dump( std::ostream& output ) const {
+  output<<"Remote memory backend:"<<backend_name(m_backend)<<"\n";
+  output<<"Syscalls:"<<m_stats.syscalls<<"\n";
+  output<<"BytesRead:"<<m_stats.bytes_read<<"\n";
+  output<<"BytesWritten:"<<m_stats.bytes_written<<"\n";
+}
+
+ssize_t remote_memory::vm_read( uintptr_t addr , void* buf , size_t len ) {
+  if(!m_vm_supported) return -1;
+  struct iovec local;
+  struct iovec remote;
+  local.iov_base = buf;
+  local.iov_len = len;
+  remote.iov_base = reinterpret_cast<void*>(addr);
+  remote.iov_len = len;
+
+  errno = 0;
+  ++m_stats.syscalls;
+  ssize_t ret = ::process_vm_readv(m_pid,&local,1,&remote,1,0);
+  if(ret < 0) {
+    if(errno == ENOSYS || errno == EPERM) {
+      LOG(WARNING)<<"process_vm_readv("<<m_pid<<") is not usable:"
+        <<std::strerror(errno)<<", fall back to ptrace!";
+      m_vm_supported = false;
+      return -1;
+    }
+    // EFAULT and friends , nothing is transferred
+    return 0;
+  }
+  return ret;
+}
+
+ssize_t remote_memory::vm_write( uintptr_t addr , const void* buf ,
+    size_t len ) {
+  if(!m_vm_supported) return -1;
+  struct iovec local;
+  struct iovec remote;
+  local.iov_base = const_cast<void*>(buf);
+  local.iov_len = len;
+  remote.iov_base = reinterpret_cast<void*>(addr);
+  remote.iov_len = len;
+
+  errno = 0;
+  ++m_stats.syscalls;
+  ssize_t ret = ::process_vm_writev(m_pid,&local,1,&remote,1,0);
+  if(ret < 0) {
+    if(errno == ENOSYS || errno == EPERM) {
+      LOG(WARNING)<<"process_vm_writev("<<m_pid<<") is not usable:"
+        <<std::strerror(errno)<<", fall back to ptrace!";
+      m_vm_supported = false;
+      return -1;
+    }
+    // Typically EFAULT since the page is write protected text
+    return 0;
+  }
+  return ret;
+}
+
+ssize_t remote_memory::mem_read( uintptr_t addr , void* buf , size_t len ) {
+  if(!m_mem_fd) return -1;
+  ssize_t ret;
+  do {
+    errno = 0;
+    ++m_stats.syscalls;
+    ret = ::pread(m_mem_fd.fd(),buf,len,static_cast<off_t>(addr));
+  } while(ret < 0 && errno == EINTR);
+  if(ret < 0) {
+    LOG(ERROR)<<"pread(/proc/"<<m_pid<<"/mem,"<<std::hex<<addr<<std::dec
+      <<","<<len<<") failed with:"<<std::strerror(errno);
+    return -1;
+  }
+  return ret;
+}
+
+ssize_t remote_memory::mem_write( uintptr_t addr , const void* buf ,
+    size_t len ) {
+  if(!m_mem_fd) return -1;
+  ssize_t ret;
+  do {
+    errno = 0;
+    ++m_stats.syscalls;
+    ret = ::pwrite(m_mem_fd.fd(),buf,len,static_cast<off_t>(addr));
+  } while(ret < 0 && errno == EINTR);
+  if(ret < 0) {
+    LOG(ERROR)<<"pwrite(/proc/"<<m_pid<<"/mem,"<<std::hex<<addr<<std::dec
+      <<","<<len<<") failed with:"<<std::strerror(errno);
+    return -1;
+  }
+  return ret;
+}
+
+bool remote_memory::ptrace_read( uintptr_t addr , void* buf , size_t len ) {
+  const size_t loops = len / kWordSize;
+  const size_t trailer = len - loops * kWordSize;
+  char* output = static_cast<char*>(buf);
+
+  m_stats.syscalls += loops + (trailer ? 1 : 0);
+
+  for( size_t i = 0 ; i < loops ; ++i ) {
+    uintptr_t b;
+    if(!ptrace_peek(m_pid,addr+i*kWordSize,&b))
+      return false;
+    memcpy(output+i*kWordSize,&b,kWordSize);
+  }
+
+  if(trailer) {
+    uintptr_t b;
+    if(!ptrace_peek(m_pid,addr+loops*kWordSize,&b))
+      return false;
+    memcpy(output+loops*kWordSize,&b,trailer);
+  }
+  return true;
+}
+
+bool remote_memory::ptrace_write( uintptr_t addr , const void* src ,
+    size_t len ) {
+  const size_t loops = len / kWordSize;
+  const size_t trailer = len - loops * kWordSize;
+  const char* buf = static_cast<const char*>(src);
+
+  // Trailer costs one more peek and one more poke
+  m_stats.syscalls += loops + (trailer ? 2 : 0);
+
+  for( size_t i = 0 ; i < loops ; ++i ) {
+    uintptr_t b;
+    memcpy(&b,buf+i*kWordSize,kWordSize);
+    if(!ptrace_poke(m_pid,addr+i*kWordSize,b))
+      return false;
+  }
+
+  if(trailer) {
+    // Peek the last word and merge the trailing bytes into it
+    uintptr_t b;
+    if(!ptrace_peek(m_pid,addr+loops*kWordSize,&b))
+      return false;
+    base::int64_array arr(b);
+    assert(trailer < kWordSize);
+    for( size_t i = 0 ; i < trailer ; ++i ) {
+      arr[i] = buf[loops*kWordSize+i];
+    }
+    if(!ptrace_poke(m_pid,addr+loops*kWordSize,arr.to_int64()))
+      return false;
+  }
+  return true;
+}
+
+bool remote_memory::read( uintptr_t addr , void* buf , size_t len ) {
+  char* output = static_cast<char*>(buf);
+  size_t done = 0;
+  m_stats.bytes_read += len;
+
+  while(done < len && m_backend != PTRACE) {
+    ssize_t ret = m_backend == PROC_MEM ?
+      mem_read(addr+done,output+done,len-done) :
+      vm_read(addr+done,output+done,len-done);
+    if(ret <= 0) break;
+    done += static_cast<size_t>(ret);
+  }
+  if(done == len) return true;
+  return ptrace_read(addr+done,output+done,len-done);
+}
+
+bool remote_memory::write( uintptr_t addr , const void* buf , size_t len ) {
+  const char* input = static_cast<const char*>(buf);
+  size_t done = 0;
+  m_stats.bytes_written += len;
+
+  while(done < len && m_backend != PTRACE) {
+    ssize_t ret = m_backend == PROC_MEM ?
+      mem_write(addr+done,input+done,len-done) :
+      vm_write(addr+done,input+done,len-done);
+    if(ret <= 0) break;
+    done += static_cast<size_t>(ret);
+  }
+  if(done == len) return true;
+  // The rest is write protected ( or the backend is not usable ) , go
+  // through ptrace which ignores the page protection
+  return ptrace_write(addr+done,input+done,len-done);
+}
+
+} // namespace dynhook
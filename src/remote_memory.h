@@ -0,0 +1,106 @@
+#ifndef REMOTE_MEMORY_H_
+#define REMOTE_MEMORY_H_
+#include "base.h"
+
+#include <cstddef>
+#include <string>
+#include <iostream>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <boost/noncopyable.hpp>
+
+namespace dynhook {
+
+// Transport layer for moving bytes between the tracer and the traced
+// process. All the code that needs to touch the remote memory should go
+// through this class instead of calling ptrace_peek/ptrace_poke directly.
+//
+// We have 3 different backends :
+// 1) PTRACE : one PTRACE_PEEKTEXT/POKETEXT per machine word. This is the
+// slowest one and it is kept as baseline and as last resort fallback.
+// 2) VM : process_vm_readv/process_vm_writev , one call for a whole range.
+// The vectored calls respect the page protection of the target, so writing
+// into r-x text fails with EFAULT ; in that case we fall back to ptrace for
+// the part that is not yet transferred.
+// 3) PROC_MEM : pread/pwrite on /proc/<pid>/mem which is opened once. The
+// kernel uses forced access for this file , so r-x text can be written at
+// arbitrary offset and length with one syscall.
+//
+// The ptrace path requires the process to be stopped by us , which is
+// always true when we patch text.
+class remote_memory : private boost::noncopyable {
+ public:
+  enum {
+    PTRACE,
+    VM,
+    PROC_MEM
+  };
+
+  remote_memory( pid_t pid , int backend );
+
+  // Read len bytes started at remote address addr into buf
+  bool read( uintptr_t addr , void* buf , size_t len );
+
+  // Write len bytes from buf into remote address addr
+  bool write( uintptr_t addr , const void* buf , size_t len );
+
+  pid_t pid() const {
+    return m_pid;
+  }
+
+  int backend() const {
+    return m_backend;
+  }
+
+  // Parse the backend name used in command line , return -1 if the name
+  // is not recognized
+  static int parse_backend( const std::string& name );
+  static const char* backend_name( int backend );
+
+  // Statistics of the traffic , used to compare the backends
+  struct statistics {
+    size_t syscalls;
+    size_t bytes_read;
+    size_t bytes_written;
+    statistics():
+      syscalls(0),
+      bytes_read(0),
+      bytes_written(0)
+    {}
+  };
+
+  const statistics& stats() const {
+    return m_stats;
+  }
+
+  void dump( std::ostream& output ) const;
+
+ private:
+  // Return how many bytes has been transferred , -1 means the backend
+  // is not usable at all and caller should fall back to ptrace
+  ssize_t vm_read( uintptr_t addr , void* buf , size_t len );
+  ssize_t vm_write( uintptr_t addr , const void* buf , size_t len );
+
+  ssize_t mem_read( uintptr_t addr , void* buf , size_t len );
+  ssize_t mem_write( uintptr_t addr , const void* buf , size_t len );
+
+  bool ptrace_read( uintptr_t addr , void* buf , size_t len );
+  bool ptrace_write( uintptr_t addr , const void* buf , size_t len );
+
+ private:
+  pid_t m_pid;
+
+  int m_backend;
+
+  // Whether process_vm_readv/process_vm_writev works for this target. Once
+  // we get ENOSYS/EPERM we stop trying them.
+  bool m_vm_supported;
+
+  // File descriptor of /proc/<pid>/mem , only opened for PROC_MEM backend
+  base::scoped_fd m_mem_fd;
+
+  statistics m_stats;
+};
+
+} // namespace dynhook
+#endif // REMOTE_MEMORY_H_
@@ -0,0 +1,182 @@
+#include "shadow_memory.h"
+#include "remote_memory.h"
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <boost/scoped_array.hpp>
+
+#include <glog/logging.h>
+
+namespace dynhook {
+
+bool shadow_memory::load( uintptr_t addr , size_t len ) {
+  if(len == 0) return true;
+  const uintptr_t first = page_base(addr);
+  const uintptr_t last = page_base(addr+len-1);
+
+  uintptr_t pos = first;
+  while(pos <= last) {
+    if(m_pages.find(pos) != m_pages.end()) {
+      pos += kPageSize;
+      continue;
+    }
+    // Find the run of missing pages and load them with one read
+    uintptr_t end = pos;
+    while(end <= last && m_pages.find(end) == m_pages.end())
+      end += kPageSize;
+
+    const size_t size = end - pos;
+    boost::scoped_array<char> buffer( new char[size] );
+    if(!m_memory->read(pos,buffer.get(),size)) {
+      LOG(ERROR)<<"Cannot load remote pages from:"<<std::hex<<pos
+        <<" until:"<<end<<std::dec<<" into shadow memory!";
+      return false;
+    }
+
+    for( uintptr_t p = pos ; p < end ; p += kPageSize ) {
+      page* pg = new page();
+      memcpy(pg->shadow,buffer.get()+(p-pos),kPageSize);
+      memcpy(pg->remote,buffer.get()+(p-pos),kPageSize);
+      uintptr_t key = p;
+      m_pages.insert(key,pg);
+    }
+    pos = end;
+  }
+  return true;
+}
+
+bool shadow_memory::read( uintptr_t addr , void* buf , size_t len ) {
+  if(!load(addr,len)) return false;
+  char* output = static_cast<char*>(buf);
+  size_t done = 0;
+  while(done < len) {
+    const uintptr_t cur = addr + done;
+    const uintptr_t base = page_base(cur);
+    const size_t offset = cur - base;
+    const size_t sz = std::min(kPageSize - offset, len - done);
+    page_map::const_iterator itr = m_pages.find(base);
+    assert(itr != m_pages.end());
+    memcpy(output+done,itr->second->shadow+offset,sz);
+    done += sz;
+  }
+  return true;
+}
+
+bool shadow_memory::write( uintptr_t addr , const void* buf , size_t len ) {
+  if(!load(addr,len)) return false;
+  const char* input = static_cast<const char*>(buf);
+  size_t done = 0;
+  while(done < len) {
+    const uintptr_t cur = addr + done;
+    const uintptr_t base = page_base(cur);
+    const size_t offset = cur - base;
+    const size_t sz = std::min(kPageSize - offset, len - done);
+    page_map::iterator itr = m_pages.find(base);
+    assert(itr != m_pages.end());
+    memcpy(itr->second->shadow+offset,input+done,sz);
+    itr->second->touched = true;
+    done += sz;
+  }
+  return true;
+}
+
+bool shadow_memory::flush( uintptr_t start , uintptr_t end ) {
+  const size_t size = end - start;
+  boost::scoped_array<char> buffer( new char[size] );
+  if(!read(start,buffer.get(),size)) return false;
+  if(!m_memory->write(start,buffer.get(),size)) {
+    LOG(ERROR)<<"Cannot flush shadow memory from:"<<std::hex<<start
+      <<" until:"<<end<<std::dec<<" into remote process!";
+    return false;
+  }
+
+  // Now the remote side has the same content as the shadow
+  uintptr_t pos = start;
+  while(pos < end) {
+    const uintptr_t base = page_base(pos);
+    const size_t offset = pos - base;
+    const size_t sz = std::min(kPageSize - offset,
+        static_cast<size_t>(end - pos));
+    page_map::iterator itr = m_pages.find(base);
+    assert(itr != m_pages.end());
+    memcpy(itr->second->remote+offset,itr->second->shadow+offset,sz);
+    pos += sz;
+  }
+  ++m_commit_count;
+  m_commit_bytes += size;
+  return true;
+}
+
+bool shadow_memory::commit() {
+  // Walk all the touched pages in address order and compute the ranges
+  // that differ from the remote copy. Ranges that are close enough are
+  // merged so we flush them with one write.
+  bool has_range = false;
+  uintptr_t range_start = 0;
+  uintptr_t range_end = 0;
+
+  for( page_map::iterator itr = m_pages.begin() ;
+      itr != m_pages.end() ; ++itr ) {
+    page& pg = *itr->second;
+    if(!pg.touched) continue;
+    const uintptr_t base = itr->first;
+
+    size_t i = 0;
+    while(i < kPageSize) {
+      if(pg.shadow[i] == pg.remote[i]) {
+        ++i;
+        continue;
+      }
+      size_t j = i + 1;
+      while(j < kPageSize && pg.shadow[j] != pg.remote[j])
+        ++j;
+
+      const uintptr_t start = base + i;
+      const uintptr_t end = base + j;
+      if(has_range && start - range_end <= kCoalesceGap) {
+        range_end = end;
+      } else {
+        if(has_range && !flush(range_start,range_end))
+          return false;
+        has_range = true;
+        range_start = start;
+        range_end = end;
+      }
+      i = j;
+    }
+  }
+
+  if(has_range && !flush(range_start,range_end))
+    return false;
+
+  for( page_map::iterator itr = m_pages.begin() ;
+      itr != m_pages.end() ; ++itr ) {
+    itr->second->touched = false;
+  }
+  return true;
+}
+
+bool shadow_memory::dirty() const {
+  for( page_map::const_iterator itr = m_pages.begin() ;
+      itr != m_pages.end() ; ++itr ) {
+    const page& pg = *itr->second;
+    if(pg.touched && memcmp(pg.shadow,pg.remote,kPageSize) != 0)
+      return true;
+  }
+  return false;
+}
+
+void shadow_memory::drop( uintptr_t addr , size_t len ) {
+  if(len == 0) return;
+  m_pages.erase(m_pages.lower_bound(page_base(addr)),
+      m_pages.upper_bound(page_base(addr+len-1)));
+}
+
+void shadow_memory::dump( std::ostream& output ) const {
+  output<<"Shadow memory pages:"<<m_pages.size()<<"\n";
+  output<<"Flushed writes:"<<m_commit_count<<"\n";
+  output<<"Flushed bytes:"<<m_commit_bytes<<"\n";
+}
+
+} // namespace dynhook
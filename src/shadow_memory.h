@@ -0,0 +1,88 @@
+#ifndef SHADOW_MEMORY_H_
+#define SHADOW_MEMORY_H_
+#include "base.h"
+
+#include <cstddef>
+#include <iostream>
+#include <inttypes.h>
+#include <boost/noncopyable.hpp>
+#include <boost/ptr_container/ptr_map.hpp>
+
+namespace dynhook {
+class remote_memory;
+
+// A tracer side shadow copy of the remote memory, keyed by remote page.
+//
+// Pages are loaded lazily on the first read/write. Writes only go into the
+// shadow , they are flushed into the target process by commit. For each
+// page we keep 2 copies : what we want the page to be and what we believe
+// the remote page currently is. The commit compares them and writes the
+// differences back as a small set of coalesced ranges , so writing the
+// old bytes back or writing the same stub twice costs nothing.
+//
+// The shadow assumes nobody else modifies the cached pages , which holds
+// for the text we patch and the memory we allocate for detour buffers. It
+// must not be used for data that the target process keeps updating.
+class shadow_memory : private boost::noncopyable {
+ public:
+  static const size_t kPageSize = 4096;
+
+  // Two dirty ranges that are this close are flushed by one write
+  static const size_t kCoalesceGap = 16;
+
+  explicit shadow_memory( remote_memory* memory ):
+    m_memory(memory),
+    m_pages(),
+    m_commit_count(0),
+    m_commit_bytes(0)
+  {}
+
+  bool read( uintptr_t addr , void* buf , size_t len );
+
+  bool write( uintptr_t addr , const void* buf , size_t len );
+
+  // Flush all the modification into the remote process
+  bool commit();
+
+  // Whether we have anything that is not flushed yet
+  bool dirty() const;
+
+  // Forget the pages that overlap [addr,addr+len) , for memory the process
+  // has unmapped. Whatever is not flushed there is lost.
+  void drop( uintptr_t addr , size_t len );
+
+  void dump( std::ostream& output ) const;
+
+ private:
+  struct page {
+    char shadow[kPageSize]; // What we want the remote page to be
+    char remote[kPageSize]; // What the remote page is right now
+    bool touched; // Whether we wrote this page since last commit
+    page():
+      touched(false)
+    {}
+  };
+
+  typedef boost::ptr_map<uintptr_t,page> page_map;
+
+  // Make sure all the pages that overlap [addr,addr+len) are loaded
+  bool load( uintptr_t addr , size_t len );
+
+  static uintptr_t page_base( uintptr_t addr ) {
+    return addr & ~(kPageSize-1);
+  }
+
+  // Flush one coalesced range , data comes from the shadow pages
+  bool flush( uintptr_t start , uintptr_t end );
+
+ private:
+  remote_memory* m_memory;
+  page_map m_pages;
+
+  // Statistics
+  size_t m_commit_count;
+  size_t m_commit_bytes;
+};
+
+} // namespace dynhook
+#endif // SHADOW_MEMORY_H_
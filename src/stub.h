@@ -5,11 +5,15 @@
 #include <memory>
 #include <iostream>
 
+#include <vector>
+
 #include <inttypes.h>
 
 #include <boost/scoped_array.hpp>
 #include <boost/noncopyable.hpp>
 
+#include "process_info.h"
+
 
 // All these following stub classes are used for code injection.
 // The contains specific machine code that perform specific injection
@@ -18,7 +22,7 @@
 // Look for the specific notes for how the registers protocol works
 
 namespace dynhook {
-class process_info;
+class remote_allocator;
 
 class stub {
  public:
@@ -217,6 +221,10 @@ class mem_unmap : public stub {
 // The r8 is used to store the base address of mapped memory
 // The r9 is used to store where the *OLD* hooked function's pointer
 //
+// The setter is called as setter(old_function,target) , target is the
+// address of the hooked function. A setter with one argument just ignores
+// it ; a pattern target calls the same setter once per matched function.
+//
 // Return value is stored inside of rax.
 // If rax is 1, then failed at loading so object;
 // if rax is 2, then failed at loading the sybmol;
@@ -225,9 +233,10 @@ class set_patched_func : public stub , private boost::noncopyable {
  public:
   static set_patched_func* create( const process_info& info ,
       const std::string& so,
-      const std::string& func ) {
+      const std::string& func ,
+      uintptr_t target = 0 ) {
     std::auto_ptr<set_patched_func> ptr( new set_patched_func() );
-    if(!ptr->init(info,so,func)) return NULL;
+    if(!ptr->init(info,so,func,target)) return NULL;
     return ptr.release();
   }
 
@@ -254,7 +263,8 @@ class set_patched_func : public stub , private boost::noncopyable {
   void dump( std::ostream& );
 
  private:
-  bool init( const process_info& , const std::string& , const std::string& );
+  bool init( const process_info& , const std::string& , const std::string& ,
+      uintptr_t target );
 
  private:
   set_patched_func():
@@ -273,6 +283,277 @@ class set_patched_func : public stub , private boost::noncopyable {
   std::string m_func_name;
 };
 
+// Call the resolver of an IFUNC symbol , which returns the implementation
+// the process is bound to , for example the AVX2 variant of memcpy. On x86
+// 64 the resolvers of glibc don't take any argument , they read the cpu
+// features that the dynamic linker has initialized already.
+//
+// The stack pointer is moved below the red zone of whatever the stopped
+// thread is running and aligned before the call.
+//
+// The return value is stored inside of rax , 0 if the resolver doesn't
+// select anything.
+class call_resolver : public stub , private boost::noncopyable {
+ public:
+  static call_resolver* create( const process_info& proc ,
+      uintptr_t resolver ) {
+    std::auto_ptr<call_resolver> ret( new call_resolver() );
+    if(!ret->init(proc,resolver)) return NULL;
+    return ret.release();
+  }
+
+  virtual void* code() const {
+    return m_code.get();
+  }
+
+  virtual size_t size() const {
+    return m_code_size;
+  }
+
+  virtual size_t rip_offset() const {
+    return 0;
+  }
+
+  uintptr_t resolver() const {
+    return m_resolver;
+  }
+
+  void dump( std::ostream& );
+
+ private:
+  bool init( const process_info& , uintptr_t resolver );
+
+ private:
+  call_resolver():
+    stub(),
+    m_code(),
+    m_code_size(0),
+    m_resolver(0)
+  {}
+
+  boost::scoped_array<char> m_code;
+  size_t m_code_size;
+  uintptr_t m_resolver;
+};
+
+// A symbol to load by load_symbol_batch
+struct symbol_request {
+  std::string so;
+  std::string name;
+
+  symbol_request( const std::string& s , const std::string& n ):
+    so(s),
+    name(n)
+  {}
+};
+
+// Load many symbols in one invoke : every distinct so object is opened
+// once via dlopen and each of its symbols is loaded via dlsym. The results
+// are written into a table in memory of the remote allocator , which has
+// one slot per so object ( the dlopen handle ) followed by one slot per
+// request ( the dlsym result ) ; a slot is 0 on failure. The symbols of an
+// so object that cannot be opened are not touched.
+//
+// The strings are placed in front of the code like load_symbol does. The
+// dlopen handle is kept in r12 while its symbols are loaded.
+class load_symbol_batch : public stub , private boost::noncopyable {
+ public:
+  static load_symbol_batch* create( const process_info& proc ,
+      const std::vector<symbol_request>& requests ,
+      uintptr_t table ) {
+    std::auto_ptr<load_symbol_batch> ret( new load_symbol_batch() );
+    if(!ret->init(proc,requests,table)) return NULL;
+    return ret.release();
+  }
+
+  // Bytes of the result table for the requests
+  static size_t table_size( const std::vector<symbol_request>& requests );
+
+  virtual void* code() const {
+    return m_code.get();
+  }
+
+  virtual size_t size() const {
+    return m_code_size;
+  }
+
+  virtual size_t rip_offset() const {
+    return m_data_size;
+  }
+
+  // Distinct so objects in the order they are opened
+  const std::vector<std::string>& libraries() const {
+    return m_libraries;
+  }
+
+  // Index into libraries of each request
+  const std::vector<size_t>& library_of() const {
+    return m_library_of;
+  }
+
+  void dump( std::ostream& );
+
+ private:
+  load_symbol_batch():
+    stub(),
+    m_code(),
+    m_code_size(0),
+    m_data_size(0),
+    m_libraries(),
+    m_library_of()
+  {}
+
+  bool init( const process_info& , const std::vector<symbol_request>& ,
+      uintptr_t table );
+
+ private:
+  boost::scoped_array<char> m_code;
+  size_t m_code_size;
+  size_t m_data_size;
+  std::vector<std::string> m_libraries;
+  std::vector<size_t> m_library_of;
+};
+
+// One call of call_entry_batch
+struct entry_call {
+  uintptr_t entry;    // The Entry function loaded from the so object
+  uintptr_t original; // Where the original function can be called
+  uintptr_t target;   // The hooked function
+
+  entry_call( uintptr_t e , uintptr_t o , uintptr_t t ):
+    entry(e),
+    original(o),
+    target(t)
+  {}
+};
+
+// Call every Entry as entry(original,target) in one invoke , the functions
+// are loaded by load_symbol_batch already so no dlopen is needed. It is
+// the batch version of set_patched_func. Return value is always 0.
+class call_entry_batch : public stub , private boost::noncopyable {
+ public:
+  static call_entry_batch* create( const process_info& proc ,
+      const std::vector<entry_call>& calls ) {
+    std::auto_ptr<call_entry_batch> ret( new call_entry_batch() );
+    if(!ret->init(proc,calls)) return NULL;
+    return ret.release();
+  }
+
+  virtual void* code() const {
+    return m_code.get();
+  }
+
+  virtual size_t size() const {
+    return m_code_size;
+  }
+
+  virtual size_t rip_offset() const {
+    return 0;
+  }
+
+  void dump( std::ostream& );
+
+ private:
+  call_entry_batch():
+    stub(),
+    m_code(),
+    m_code_size(0)
+  {}
+
+  bool init( const process_info& , const std::vector<entry_call>& );
+
+ private:
+  boost::scoped_array<char> m_code;
+  size_t m_code_size;
+};
+
+// The loop of the agent thread , see agent. The code is position
+// independent and written into memory of the remote allocator , it is the
+// start routine of the thread with the ring as its argument. Commands are
+// run with raw syscalls and an indirect call , nothing else is needed.
+class agent_loop : public stub , private boost::noncopyable {
+ public:
+  static agent_loop* create( const process_info& proc ) {
+    std::auto_ptr<agent_loop> ret( new agent_loop() );
+    if(!ret->init(proc)) return NULL;
+    return ret.release();
+  }
+
+  virtual void* code() const {
+    return m_code.get();
+  }
+
+  virtual size_t size() const {
+    return m_code_size;
+  }
+
+  virtual size_t rip_offset() const {
+    return 0;
+  }
+
+  void dump( std::ostream& );
+
+ private:
+  agent_loop():
+    stub(),
+    m_code(),
+    m_code_size(0)
+  {}
+
+  bool init( const process_info& );
+
+ private:
+  boost::scoped_array<char> m_code;
+  size_t m_code_size;
+};
+
+// Start the agent thread :
+// 1) memfd_create , ftruncate and mmap it shared as the ring
+// 2) pthread_create with the agent_loop code and the ring , the thread is
+// detached right away
+//
+// The ring records its own address and the fd , the fd stays open until
+// the tracer has opened it through /proc/pid/fd.
+//
+// The return value is stored inside of rax , the fd on success or -1.
+class start_agent : public stub , private boost::noncopyable {
+ public:
+  static start_agent* create( const process_info& proc , uintptr_t loop ) {
+    std::auto_ptr<start_agent> ret( new start_agent() );
+    if(!ret->init(proc,loop)) return NULL;
+    return ret.release();
+  }
+
+  virtual void* code() const {
+    return m_code.get();
+  }
+
+  virtual size_t size() const {
+    return m_code_size;
+  }
+
+  virtual size_t rip_offset() const {
+    return m_data_size;
+  }
+
+  void dump( std::ostream& );
+
+ private:
+  start_agent():
+    stub(),
+    m_code(),
+    m_code_size(0),
+    m_data_size(0)
+  {}
+
+  bool init( const process_info& , uintptr_t loop );
+
+ private:
+  boost::scoped_array<char> m_code;
+  size_t m_code_size;
+  size_t m_data_size;
+};
+
 // This shell is used to patch the hooked function and make it work/function.
 // The patch is doing as follow:
 // 1) We will use mem_map to grab a chunk of memory that can be really
@@ -286,8 +567,28 @@ class set_patched_func : public stub , private boost::noncopyable {
 // The argument r9 is used when you put stub as set_patched_func
 // the r8 register is always set to where the code gets mapped
 // automatically inside of the invoke call
+//
+// The code runs in a private scratch area that the first invoke maps ,
+// later invokes just overwrite it.
 bool invoke( process_info* , const stub& code ,
     uintptr_t r9 , uintptr_t *ret );
 
+// Load the symbols through one load_symbol_batch invoke. The output has
+// the address of each request. False if any so object cannot be opened ,
+// any symbol cannot be found or the invoke fails.
+bool load_symbols( process_info* , remote_allocator* ,
+    const std::vector<symbol_request>& , std::vector<uintptr_t>* output );
+
+// Call the entries through one call_entry_batch invoke
+bool call_entries( process_info* , const std::vector<entry_call>& );
+
+// The function an IFUNC symbol is resolved to in the remote process. The
+// resolver is invoked through call_resolver and the implementation is
+// found by address , through .eh_frame_hdr if it is not in the dynamic
+// symbol table , which is the case for the variants of glibc. A symbol
+// that is not an IFUNC is returned as is. NULL if it cannot be resolved.
+const process_info::symbol_info* resolve_ifunc( process_info* ,
+    const process_info::symbol_info& );
+
 } // namespace dynhook
 #endif // STUB_H_
@@ -0,0 +1,190 @@
+#include "symbol_cache.h"
+#include "symbol_table.h"
+#include "elf_image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <glog/logging.h>
+#include <boost/format.hpp>
+
+namespace dynhook {
+
+namespace {
+const char kMagic[8] = { 'D','Y','N','H','S','Y','M','\0' };
+
+// Hex string of the NT_GNU_BUILD_ID note , empty if there's none
+std::string build_id_of( const elf_image& image ) {
+  for( const Elf64_Phdr* seg = image.next_segment(PT_NOTE) ; seg ;
+      seg = image.next_segment(PT_NOTE,seg) ) {
+    const char* note = image.at(seg->p_offset,seg->p_filesz);
+    if(!note) continue;
+    size_t pos = 0;
+    while(pos + sizeof(Elf64_Nhdr) <= seg->p_filesz) {
+      const Elf64_Nhdr* nhdr = reinterpret_cast<const Elf64_Nhdr*>(note+pos);
+      const size_t name = pos + sizeof(Elf64_Nhdr);
+      const size_t desc = name + base::alignment(nhdr->n_namesz,4);
+      const size_t next = desc + base::alignment(nhdr->n_descsz,4);
+      if(next > seg->p_filesz) break;
+      if(nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+         memcmp(note+name,"GNU",4) == 0) {
+        std::string ret;
+        for( size_t i = 0 ; i < nhdr->n_descsz ; ++i ) {
+          ret += (boost::format("%02x") %
+              static_cast<unsigned>(static_cast<unsigned char>(
+                  note[desc+i]))).str();
+        }
+        return ret;
+      }
+      pos = next;
+    }
+  }
+  return std::string();
+}
+} // namespace
+
+std::string symbol_cache::key_of( const elf_image& image , bool entry ) {
+  std::string key = build_id_of(image);
+  if(key.empty()) {
+    struct stat st;
+    if(::stat(image.path().c_str(),&st)) return std::string();
+    key = (boost::format("ino-%x-%x-%x-%x") % st.st_dev % st.st_ino %
+        st.st_mtime % st.st_size).str();
+  }
+  return entry ? key + ".exe" : key;
+}
+
+bool symbol_cache::valid() const {
+  if(m_size < sizeof(file_header)) return false;
+  const file_header& h = header();
+  if(memcmp(h.magic,kMagic,sizeof(kMagic)) != 0 || h.version != kVersion)
+    return false;
+  const uint64_t entries = sizeof(file_header) +
+    static_cast<uint64_t>(h.count) * sizeof(file_entry);
+  return h.names >= entries && h.names <= m_size &&
+    h.names_size <= m_size - h.names;
+}
+
+symbol_cache* symbol_cache::open( const std::string& dir ,
+    const std::string& key ) {
+  const std::string path = path_of(dir,key);
+  base::scoped_fd fd( ::open(path.c_str(),O_RDONLY|O_CLOEXEC) );
+  if(!fd) return NULL;
+
+  struct stat st;
+  if(::fstat(fd.fd(),&st) || st.st_size == 0) return NULL;
+  void* addr = ::mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd.fd(),0);
+  if(addr == MAP_FAILED) {
+    LOG(WARNING)<<"Cannot mmap symbol cache:"<<path<<" with error:"
+      <<std::strerror(errno);
+    return NULL;
+  }
+
+  symbol_cache* ret = new symbol_cache(static_cast<const char*>(addr),
+      static_cast<size_t>(st.st_size));
+  if(!ret->valid()) {
+    LOG(WARNING)<<"Ignore broken symbol cache:"<<path<<"!";
+    delete ret;
+    return NULL;
+  }
+  return ret;
+}
+
+symbol_cache::~symbol_cache() {
+  ::munmap(const_cast<char*>(m_data),m_size);
+}
+
+void symbol_cache::fill( const process_info::module_info* minfo ,
+    uintptr_t offset , symbol_table* table ) const {
+  const file_header& h = header();
+  const file_entry* entry = reinterpret_cast<const file_entry*>(
+      m_data + sizeof(file_header));
+  const char* names = m_data + h.names;
+  for( const file_entry* end = entry + h.count ; entry != end ; ++entry ) {
+    if(entry->name > h.names_size ||
+       entry->name_len > h.names_size - entry->name)
+      continue;
+    table->push(process_info::symbol_info(entry->value + offset,
+          base::string_ref(names + entry->name,entry->name_len),
+          entry->size,
+          (entry->flags & WEAK) != 0,
+          minfo,
+          &entry->analysis,
+          (entry->flags & IFUNC) != 0));
+  }
+}
+
+bool symbol_cache::write( const std::string& dir , const std::string& key ,
+    const symbol_table& table , const elf_image& image , uintptr_t offset ) {
+  std::vector<file_entry> entries;
+  std::string names;
+  entries.reserve(table.size());
+  for( size_t i = 0 ; i < table.size() ; ++i ) {
+    const std::string name = table.name(i);
+    file_entry entry;
+    entry.value = table.base(i) - offset;
+    entry.size = table.symbol_size(i);
+    entry.name = static_cast<uint32_t>(names.size());
+    entry.name_len = static_cast<uint32_t>(name.size());
+    entry.flags = (table.weak(i) ? WEAK : 0) | (table.ifunc(i) ? IFUNC : 0);
+    const char* code = image.at_vaddr(entry.value,entry.size);
+    if(code && entry.size) {
+      entry.analysis = function_analysis::analyze(code,entry.size);
+    } else {
+      // Not backed by the file , always analyze the live code
+      entry.analysis = function_analysis();
+      entry.analysis.flags = function_analysis::UNDECODABLE;
+    }
+    names.append(name);
+    names.push_back('\0');
+    entries.push_back(entry);
+  }
+
+  file_header h;
+  memset(&h,0,sizeof(h));
+  memcpy(h.magic,kMagic,sizeof(kMagic));
+  h.version = kVersion;
+  h.count = static_cast<uint32_t>(entries.size());
+  h.names = sizeof(h) + entries.size() * sizeof(file_entry);
+  h.names_size = names.size();
+
+  // Write a private file and rename it , so a concurrent reader sees
+  // either nothing or the whole file
+  ::mkdir(dir.c_str(),0755);
+  const std::string path = path_of(dir,key);
+  const std::string tmp = (boost::format("%s.%d") % path % ::getpid()).str();
+  {
+    std::ofstream file(tmp.c_str(),std::ios::out|std::ios::binary|
+        std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&h),sizeof(h));
+    if(!entries.empty()) {
+      file.write(reinterpret_cast<const char*>(&entries[0]),
+          entries.size() * sizeof(file_entry));
+    }
+    file.write(names.data(),names.size());
+    if(!file) {
+      LOG(WARNING)<<"Cannot write symbol cache:"<<tmp<<"!";
+      ::unlink(tmp.c_str());
+      return false;
+    }
+  }
+  if(::rename(tmp.c_str(),path.c_str())) {
+    LOG(WARNING)<<"Cannot rename symbol cache:"<<tmp<<" with error:"
+      <<std::strerror(errno);
+    ::unlink(tmp.c_str());
+    return false;
+  }
+  LOG(INFO)<<"Write symbol cache:"<<path<<" with "<<entries.size()
+    <<" symbols of:"<<image.path();
+  return true;
+}
+
+} // namespace dynhook
@@ -0,0 +1,95 @@
+#ifndef SYMBOL_CACHE_H_
+#define SYMBOL_CACHE_H_
+#include "process_info.h"
+#include "function_analysis.h"
+
+#include <string>
+#include <cstddef>
+#include <inttypes.h>
+#include <boost/noncopyable.hpp>
+
+namespace dynhook {
+class elf_image;
+class symbol_table;
+
+// On disk cache of the function symbols of one ELF file together with the
+// analysis of each function body. The file is mapped as is : symbol names
+// and analysis handed out by fill point into the mapping , so a warm load
+// doesn't parse the ELF file nor decode any function body.
+//
+// A cache file is named after the build-id of the ELF file , or after its
+// inode/mtime/size when it doesn't have a build-id. The layout is a header,
+// an array of fixed size entries and the name blob.
+class symbol_cache : private boost::noncopyable {
+ public:
+  // Key of the ELF file , the entry module caches both of its symbol tables
+  // so it gets a different key. Empty if the file cannot be identified.
+  static std::string key_of( const elf_image& image , bool entry );
+
+  // Map the cache file , NULL if there's none or it is broken
+  static symbol_cache* open( const std::string& dir , const std::string& key );
+
+  // Analyze every function of the built table and write the cache file.
+  // The offset is what the table adds to st_value.
+  static bool write( const std::string& dir , const std::string& key ,
+      const symbol_table& table , const elf_image& image , uintptr_t offset );
+
+  ~symbol_cache();
+
+  // Fill the table with the cached symbols , the cache can be closed once
+  // the table is built
+  void fill( const process_info::module_info* minfo , uintptr_t offset ,
+      symbol_table* table ) const;
+
+  size_t size() const {
+    return header().count;
+  }
+
+ private:
+  static const uint32_t kVersion = 2;
+
+  struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count; // Number of entries
+    uint64_t names; // Offset of the name blob
+    uint64_t names_size;
+  };
+
+  struct file_entry {
+    uint64_t value; // st_value
+    uint64_t size;
+    uint32_t name; // Offset in the name blob
+    uint32_t name_len;
+    uint32_t flags; // WEAK | IFUNC
+    function_analysis analysis;
+  };
+
+  enum {
+    WEAK = 1,
+    IFUNC = 2
+  };
+
+  symbol_cache( const char* data , size_t size ):
+    m_data(data),
+    m_size(size)
+  {}
+
+  const file_header& header() const {
+    return *reinterpret_cast<const file_header*>(m_data);
+  }
+
+  bool valid() const;
+
+  static std::string path_of( const std::string& dir ,
+      const std::string& key ) {
+    return dir + "/" + key + ".sym";
+  }
+
+ private:
+  const char* m_data;
+  size_t m_size;
+};
+
+} // namespace dynhook
+#endif // SYMBOL_CACHE_H_
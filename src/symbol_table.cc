@@ -0,0 +1,294 @@
+#include "symbol_table.h"
+#include "frame_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace dynhook {
+
+namespace {
+struct address_less_than {
+  bool operator () ( const process_info::symbol_info& l ,
+      const process_info::symbol_info& r ) const {
+    return l.base < r.base;
+  }
+};
+
+// Order the indices of the symbols by name
+struct name_less_than {
+  const std::vector<process_info::symbol_info>* symbols;
+
+  explicit name_less_than( const std::vector<process_info::symbol_info>* s ):
+    symbols(s)
+  {}
+
+  bool operator () ( uint32_t l , uint32_t r ) const {
+    return (*symbols)[l].name < (*symbols)[r].name;
+  }
+};
+
+void put_varint( std::string* output , size_t value ) {
+  while(value >= 0x80) {
+    output->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  output->push_back(static_cast<char>(value));
+}
+
+size_t get_varint( const std::string& input , size_t* offset ) {
+  size_t value = 0;
+  for( int shift = 0 ; ; shift += 7 ) {
+    const unsigned char c = static_cast<unsigned char>(input[(*offset)++]);
+    value |= static_cast<size_t>(c & 0x7f) << shift;
+    if(!(c & 0x80)) break;
+  }
+  return value;
+}
+} // namespace
+
+// Decode the names of the arena one by one from the start of a block
+class symbol_table::name_cursor {
+ public:
+  name_cursor( const symbol_table& table , size_t block ):
+    m_table(table),
+    m_position(block * kBlockSize),
+    m_offset(0),
+    m_name()
+  {}
+
+  // Position of the next name
+  size_t position() const {
+    return m_position;
+  }
+
+  // Decode the name at the position and move to the next one
+  const std::string& next() {
+    const std::string& names = m_table.m_names;
+    if(m_position % kBlockSize == 0) {
+      m_offset = m_table.m_blocks[m_position / kBlockSize];
+      const size_t len = get_varint(names,&m_offset);
+      m_name.assign(names,m_offset,len);
+      m_offset += len;
+    } else {
+      const size_t shared = get_varint(names,&m_offset);
+      const size_t suffix = get_varint(names,&m_offset);
+      m_name.resize(shared);
+      m_name.append(names,m_offset,suffix);
+      m_offset += suffix;
+    }
+    ++m_position;
+    return m_name;
+  }
+
+ private:
+  const symbol_table& m_table;
+  size_t m_position;
+  size_t m_offset;
+  std::string m_name;
+};
+
+symbol_table::symbol_table():
+  m_pending(),
+  m_module(NULL),
+  m_bases(),
+  m_sizes(),
+  m_flags(),
+  m_name_of(),
+  m_analysis(),
+  m_names(),
+  m_blocks(),
+  m_slots(),
+  m_mask(0),
+  m_addresses(),
+  m_materialized()
+{}
+
+void symbol_table::encode_name( size_t position ,
+    const base::string_ref& name , const base::string_ref& previous ) {
+  if(position % kBlockSize == 0) {
+    m_blocks.push_back(static_cast<uint32_t>(m_names.size()));
+    put_varint(&m_names,name.size());
+    m_names.append(name.data(),name.size());
+    return;
+  }
+  size_t shared = 0;
+  const size_t limit = std::min(name.size(),previous.size());
+  while(shared < limit && name.data()[shared] == previous.data()[shared])
+    ++shared;
+  put_varint(&m_names,shared);
+  put_varint(&m_names,name.size() - shared);
+  m_names.append(name.data() + shared,name.size() - shared);
+}
+
+size_t symbol_table::size_from( const frame_index& frames , uintptr_t offset ) {
+  size_t count = 0;
+  for( std::vector<symbol_info>::iterator itr = m_pending.begin() ;
+      itr != m_pending.end() ; ++itr ) {
+    if(itr->size) continue;
+    uint64_t start , size;
+    // Only an FDE that starts at the symbol , not one that merely covers it
+    if(frames.find(itr->base - offset,&start,&size) &&
+       start == itr->base - offset) {
+      itr->size = size;
+      ++count;
+    }
+  }
+  return count;
+}
+
+void symbol_table::build() {
+  assert(m_bases.empty());
+  std::stable_sort(m_pending.begin(),m_pending.end(),address_less_than());
+
+  const size_t count = m_pending.size();
+  if(count) m_module = m_pending[0].module;
+
+  bool analysis = false;
+  for( size_t i = 0 ; i < count ; ++i ) {
+    if(m_pending[i].analysis) {
+      analysis = true;
+      break;
+    }
+  }
+
+  m_bases.reserve(count);
+  m_sizes.reserve(count);
+  m_flags.reserve(count);
+  if(analysis) m_analysis.reserve(count);
+  for( size_t i = 0 ; i < count ; ++i ) {
+    const symbol_info& sinfo = m_pending[i];
+    m_bases.push_back(sinfo.base);
+    m_sizes.push_back(static_cast<uint32_t>(
+          std::min<size_t>(sinfo.size,0xffffffffU)));
+    m_flags.push_back((sinfo.weak ? WEAK : 0) |
+        (sinfo.analysis ? HAS_ANALYSIS : 0) |
+        (sinfo.ifunc ? IFUNC : 0));
+    if(analysis) {
+      m_analysis.push_back(sinfo.analysis ? *sinfo.analysis :
+          function_analysis());
+    }
+  }
+
+  // Names in name order , equal names stay in address order
+  std::vector<uint32_t> order(count);
+  for( size_t i = 0 ; i < count ; ++i ) order[i] = static_cast<uint32_t>(i);
+  std::stable_sort(order.begin(),order.end(),name_less_than(&m_pending));
+
+  m_name_of.resize(count);
+  for( size_t k = 0 ; k < count ; ++k ) {
+    const uint32_t index = order[k];
+    encode_name(k,m_pending[index].name,
+        k ? m_pending[order[k-1]].name : base::string_ref());
+    m_name_of[index] = static_cast<uint32_t>(k);
+  }
+  std::string(m_names).swap(m_names);
+
+  // Keep the load factor under 1/2 so a probe sequence stays short. The
+  // symbols go in by address , so the definitions of one name are probed
+  // in address order.
+  size_t capacity = 16;
+  while(capacity < count * 2) capacity <<= 1;
+  m_slots.assign(capacity,0);
+  m_mask = capacity - 1;
+  for( size_t i = 0 ; i < count ; ++i ) {
+    size_t pos = hash(m_pending[i].name) & m_mask;
+    while(m_slots[pos]) pos = (pos + 1) & m_mask;
+    m_slots[pos] = static_cast<uint32_t>(i + 1);
+  }
+
+  m_addresses.build(m_bases);
+
+  // The names of the pending symbols may point into a file that is about
+  // to be released
+  std::vector<symbol_info>().swap(m_pending);
+}
+
+uint64_t symbol_table::hash( const base::string_ref& name ) {
+  // FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for( size_t i = 0 ; i < name.size() ; ++i ) {
+    h ^= static_cast<unsigned char>(name.data()[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+std::string symbol_table::name( size_t index ) const {
+  const size_t position = m_name_of[index];
+  name_cursor cursor(*this,position / kBlockSize);
+  while(cursor.position() < position) cursor.next();
+  return cursor.next();
+}
+
+const symbol_table::symbol_info*
+symbol_table::symbol( size_t index ) const {
+  boost::ptr_map<size_t,materialized>::const_iterator itr =
+    m_materialized.find(index);
+  if(itr != m_materialized.end()) return &itr->second->info;
+
+  std::auto_ptr<materialized> ret( new materialized() );
+  ret->name = name(index);
+  ret->info = symbol_info(m_bases[index],
+      ret->name,
+      m_sizes[index],
+      weak(index),
+      m_module,
+      (m_flags[index] & HAS_ANALYSIS) ? &m_analysis[index] : NULL,
+      ifunc(index));
+  const symbol_info* info = &ret->info;
+  size_t key = index;
+  m_materialized.insert(key,ret.release());
+  return info;
+}
+
+const symbol_table::symbol_info*
+symbol_table::find( const base::string_ref& name ) const {
+  if(m_slots.empty()) return NULL;
+  size_t fallback = address_index::npos;
+  // Every definition of the name is on the probe sequence , walk until
+  // an empty slot
+  for( size_t pos = hash(name) & m_mask ; m_slots[pos] ;
+      pos = (pos + 1) & m_mask ) {
+    const size_t index = m_slots[pos] - 1;
+    if(base::string_ref(this->name(index)) != name) continue;
+    if(!weak(index)) return symbol(index);
+    if(fallback == address_index::npos) fallback = index;
+  }
+  return fallback == address_index::npos ? NULL : symbol(fallback);
+}
+
+const symbol_table::symbol_info*
+symbol_table::find( uintptr_t address ) const {
+  return covering(m_addresses.find(address),address);
+}
+
+void symbol_table::find( const uintptr_t* addresses , size_t count ,
+    const symbol_info** output ) const {
+  size_t index[64];
+  for( size_t base = 0 ; base < count ; base += 64 ) {
+    const size_t chunk = std::min<size_t>(64,count - base);
+    m_addresses.find(addresses+base,chunk,index);
+    for( size_t i = 0 ; i < chunk ; ++i )
+      output[base+i] = covering(index[i],addresses[base+i]);
+  }
+}
+
+size_t symbol_table::memory_usage() const {
+  size_t ret = sizeof(*this) +
+    m_bases.capacity() * sizeof(uintptr_t) +
+    m_sizes.capacity() * sizeof(uint32_t) +
+    m_flags.capacity() * sizeof(uint8_t) +
+    m_name_of.capacity() * sizeof(uint32_t) +
+    m_analysis.capacity() * sizeof(function_analysis) +
+    m_names.capacity() +
+    m_blocks.capacity() * sizeof(uint32_t) +
+    m_slots.capacity() * sizeof(uint32_t) +
+    m_addresses.memory_usage();
+  for( boost::ptr_map<size_t,materialized>::const_iterator itr =
+      m_materialized.begin() ; itr != m_materialized.end() ; ++itr ) {
+    ret += sizeof(materialized) + itr->second->name.capacity();
+  }
+  return ret;
+}
+
+} // namespace dynhook
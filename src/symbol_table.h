@@ -0,0 +1,152 @@
+#ifndef SYMBOL_TABLE_H_
+#define SYMBOL_TABLE_H_
+#include "process_info.h"
+#include "address_index.h"
+#include "function_analysis.h"
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <inttypes.h>
+#include <boost/noncopyable.hpp>
+#include <boost/ptr_container/ptr_map.hpp>
+
+namespace dynhook {
+class frame_index;
+
+// Symbols of one module. The table is filled by push and then built once.
+//
+// A built table doesn't keep any symbol_info : the fields live in parallel
+// arrays sorted by address , searched through an address_index , and the
+// names are copied into one arena sorted by name and front coded , every
+// name stores only what differs from the name before it. C++ names share
+// long prefixes , so the arena is a fraction of the string tables. A name
+// is found through an open addressing hash table of symbol indices next to
+// the arena , only the names on the probe sequence are decoded.
+//
+// Lookups hand out a symbol_info that is materialized on first use and
+// kept until the table is gone , so the pointers stay valid.
+class symbol_table : private boost::noncopyable {
+ public:
+  typedef process_info::symbol_info symbol_info;
+  typedef process_info::module_info module_info;
+
+  symbol_table();
+
+  // The name only needs to live until build
+  void push( const symbol_info& info ) {
+    m_pending.push_back(info);
+  }
+
+  // Give the pushed symbols without a size the size of the function that
+  // starts at them , offset is what the symbols add to the vaddr. Returns
+  // how many symbols get a size.
+  size_t size_from( const frame_index& frames , uintptr_t offset );
+
+  // Sort the symbols and build the name index , no push after this
+  void build();
+
+  // A strong symbol is preferred if the name has more than one definition
+  const symbol_info* find( const base::string_ref& name ) const;
+
+  // The symbol whose range covers the address
+  const symbol_info* find( uintptr_t address ) const;
+
+  // Same as find for count addresses , NULL for an address not covered
+  void find( const uintptr_t* addresses , size_t count ,
+      const symbol_info** output ) const;
+
+  size_t size() const {
+    return m_bases.size();
+  }
+
+  const module_info* module() const {
+    return m_module;
+  }
+
+  // Fields of the symbol at the index , in address order
+  uintptr_t base( size_t index ) const {
+    return m_bases[index];
+  }
+
+  size_t symbol_size( size_t index ) const {
+    return m_sizes[index];
+  }
+
+  bool weak( size_t index ) const {
+    return (m_flags[index] & WEAK) != 0;
+  }
+
+  bool ifunc( size_t index ) const {
+    return (m_flags[index] & IFUNC) != 0;
+  }
+
+  std::string name( size_t index ) const;
+
+  // The symbol at the index as a symbol_info
+  const symbol_info* symbol( size_t index ) const;
+
+  // Bytes used by the built table , the materialized symbols included
+  size_t memory_usage() const;
+
+ private:
+  enum {
+    WEAK = 1,
+    HAS_ANALYSIS = 2,
+    IFUNC = 4
+  };
+
+  // Names per block of the arena , the first one is stored in full
+  static const size_t kBlockSize = 16;
+
+  struct materialized {
+    std::string name;
+    symbol_info info;
+  };
+
+  class name_cursor;
+
+  void encode_name( size_t position , const base::string_ref& name ,
+      const base::string_ref& previous );
+
+  static uint64_t hash( const base::string_ref& name );
+
+  // The symbol at the index if it covers the address
+  const symbol_info* covering( size_t index , uintptr_t address ) const {
+    if(index == address_index::npos) return NULL;
+    const uintptr_t start = m_bases[index];
+    if(address == start || address < start + m_sizes[index])
+      return symbol(index);
+    return NULL;
+  }
+
+ private:
+  // Symbols pushed but not built yet
+  std::vector<symbol_info> m_pending;
+
+  const module_info* m_module;
+
+  // Fields by address
+  std::vector<uintptr_t> m_bases;
+  std::vector<uint32_t> m_sizes;
+  std::vector<uint8_t> m_flags;
+  std::vector<uint32_t> m_name_of;   // Position of the name in the arena
+
+  // Analysis from the symbol cache , by address ; empty if there's none
+  std::vector<function_analysis> m_analysis;
+
+  // Front coded names sorted by name
+  std::string m_names;
+  std::vector<uint32_t> m_blocks;    // Arena offset of each block
+
+  // Index+1 of the symbol by the hash of its name , 0 means empty
+  std::vector<uint32_t> m_slots;
+  size_t m_mask;
+
+  address_index m_addresses;
+
+  mutable boost::ptr_map<size_t,materialized> m_materialized;
+};
+
+} // namespace dynhook
+#endif // SYMBOL_TABLE_H_
@@ -0,0 +1,42 @@
+#include "name_index.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace {
+int g_failure = 0;
+
+void expect( const std::string& pattern , const std::string& name ,
+    bool expected ) {
+  if(dynhook::name_index::matches(pattern,name) == expected) return;
+  std::fprintf(stderr,"Pattern:%s should %smatch:%s!\n",pattern.c_str(),
+      expected ? "" : "not ",name.c_str());
+  ++g_failure;
+}
+} // namespace
+
+int main() {
+  // Globs
+  expect("MyServer::Handle*","MyServer::HandleRequest(Request&)",true);
+  expect("*Codec::decode","JsonCodec::decode(Buffer&)",true);
+  expect("*Codec::decode","JsonCodec::encode(Buffer&)",false);
+
+  // Regular expressions
+  expect("/^Json.*::decode$/","JsonCodec::decode(Buffer&)",true);
+  expect("/Codec::dec/","XmlCodec::decode()",true);
+
+  // The bounds of a repeat are not a literal of the name
+  expect("/Fo{1,2}Bar/","FoBar",true);
+  expect("/Fo{1,2}Bar/","FooBar",true);
+  expect("/Fo{1,2}Bar/","FoooBar",false);
+  expect("/^Fo{2}Bar$/","FooBar",true);
+  expect("/Handler[0-9]{2,}::run/","Handler42::run()",true);
+
+  if(g_failure) {
+    std::fprintf(stderr,"%d failure(s)!\n",g_failure);
+    return EXIT_FAILURE;
+  }
+  std::printf("All passed!\n");
+  return EXIT_SUCCESS;
+}